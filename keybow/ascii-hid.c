@@ -0,0 +1,112 @@
+#include "ascii-hid.h"
+
+#define KEY(usage)     {usage, 0}
+#define SHIFTED(usage) {usage, HID_MOD_LEFT_SHIFT}
+
+/*
+    US layout. Entries left zeroed have no key, the compiler fills
+    them in, so looking a character up is a single index.
+*/
+const ascii_hid ascii_hid_table[128] = {
+    [0x07]  = KEY(0x29), // Bell, Escape as it always has been
+    ['\b']  = KEY(0x2a), // Backspace
+    ['\t']  = KEY(0x2b), // Tab
+    ['\n']  = KEY(0x28), // Enter
+    [0x1b]  = KEY(0x29), // Escape
+    [' ']   = KEY(0x2c), // Space
+    ['!']   = SHIFTED(0x1e),
+    ['"']   = SHIFTED(0x34),
+    ['#']   = SHIFTED(0x20),
+    ['$']   = SHIFTED(0x21),
+    ['%']   = SHIFTED(0x22),
+    ['&']   = SHIFTED(0x24),
+    ['\'']  = KEY(0x34),
+    ['(']   = SHIFTED(0x26),
+    [')']   = SHIFTED(0x27),
+    ['*']   = SHIFTED(0x25),
+    ['+']   = SHIFTED(0x2e),
+    [',']   = KEY(0x36),
+    ['-']   = KEY(0x2d),
+    ['.']   = KEY(0x37),
+    ['/']   = KEY(0x38),
+    ['0']   = KEY(0x27),
+    ['1']   = KEY(0x1e),
+    ['2']   = KEY(0x1f),
+    ['3']   = KEY(0x20),
+    ['4']   = KEY(0x21),
+    ['5']   = KEY(0x22),
+    ['6']   = KEY(0x23),
+    ['7']   = KEY(0x24),
+    ['8']   = KEY(0x25),
+    ['9']   = KEY(0x26),
+    [':']   = SHIFTED(0x33),
+    [';']   = KEY(0x33),
+    ['<']   = SHIFTED(0x36),
+    ['=']   = KEY(0x2e),
+    ['>']   = SHIFTED(0x37),
+    ['?']   = SHIFTED(0x38),
+    ['@']   = SHIFTED(0x1f),
+    ['A']   = SHIFTED(0x04),
+    ['B']   = SHIFTED(0x05),
+    ['C']   = SHIFTED(0x06),
+    ['D']   = SHIFTED(0x07),
+    ['E']   = SHIFTED(0x08),
+    ['F']   = SHIFTED(0x09),
+    ['G']   = SHIFTED(0x0a),
+    ['H']   = SHIFTED(0x0b),
+    ['I']   = SHIFTED(0x0c),
+    ['J']   = SHIFTED(0x0d),
+    ['K']   = SHIFTED(0x0e),
+    ['L']   = SHIFTED(0x0f),
+    ['M']   = SHIFTED(0x10),
+    ['N']   = SHIFTED(0x11),
+    ['O']   = SHIFTED(0x12),
+    ['P']   = SHIFTED(0x13),
+    ['Q']   = SHIFTED(0x14),
+    ['R']   = SHIFTED(0x15),
+    ['S']   = SHIFTED(0x16),
+    ['T']   = SHIFTED(0x17),
+    ['U']   = SHIFTED(0x18),
+    ['V']   = SHIFTED(0x19),
+    ['W']   = SHIFTED(0x1a),
+    ['X']   = SHIFTED(0x1b),
+    ['Y']   = SHIFTED(0x1c),
+    ['Z']   = SHIFTED(0x1d),
+    ['[']   = KEY(0x2f),
+    ['\\']  = KEY(0x31),
+    [']']   = KEY(0x30),
+    ['^']   = SHIFTED(0x23),
+    ['_']   = SHIFTED(0x2d),
+    ['`']   = KEY(0x35),
+    ['a']   = KEY(0x04),
+    ['b']   = KEY(0x05),
+    ['c']   = KEY(0x06),
+    ['d']   = KEY(0x07),
+    ['e']   = KEY(0x08),
+    ['f']   = KEY(0x09),
+    ['g']   = KEY(0x0a),
+    ['h']   = KEY(0x0b),
+    ['i']   = KEY(0x0c),
+    ['j']   = KEY(0x0d),
+    ['k']   = KEY(0x0e),
+    ['l']   = KEY(0x0f),
+    ['m']   = KEY(0x10),
+    ['n']   = KEY(0x11),
+    ['o']   = KEY(0x12),
+    ['p']   = KEY(0x13),
+    ['q']   = KEY(0x14),
+    ['r']   = KEY(0x15),
+    ['s']   = KEY(0x16),
+    ['t']   = KEY(0x17),
+    ['u']   = KEY(0x18),
+    ['v']   = KEY(0x19),
+    ['w']   = KEY(0x1a),
+    ['x']   = KEY(0x1b),
+    ['y']   = KEY(0x1c),
+    ['z']   = KEY(0x1d),
+    ['{']   = SHIFTED(0x2f),
+    ['|']   = SHIFTED(0x31),
+    ['}']   = SHIFTED(0x30),
+    ['~']   = SHIFTED(0x35),
+    [0x7f]  = KEY(0x4c), // Delete
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+#define HID_MOD_LEFT_SHIFT 0x02
+
+typedef struct ascii_hid {
+    unsigned char usage;     // HID keyboard usage, 0 if the character can't be typed
+    unsigned char modifiers; // Modifier bits that must be held, as in report byte 1
+} ascii_hid;
+
+extern const ascii_hid ascii_hid_table[128];
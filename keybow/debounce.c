@@ -0,0 +1,69 @@
+#include "keybow.h"
+#include "debounce.h"
+
+void debounce_init(){
+    int x;
+    for(x = 0; x < NUM_KEYS; x++){
+        debounce_keys[x].state = 0;
+        debounce_keys[x].raw = 0;
+        debounce_keys[x].raw_us = 0;
+        debounce_keys[x].edge_us = 0;
+        debounce_keys[x].rejected = 0;
+        debounce_set(x, DEBOUNCE_DEFAULT_MODE, DEBOUNCE_DEFAULT_MS, DEBOUNCE_DEFAULT_MS);
+    }
+}
+
+void debounce_set(unsigned short key_index, unsigned char mode, unsigned int press_ms, unsigned int release_ms){
+    if(key_index >= NUM_KEYS) return;
+    debounce_keys[key_index].mode = mode;
+    debounce_keys[key_index].press_us = press_ms * 1000;
+    debounce_keys[key_index].release_us = release_ms * 1000;
+}
+
+static int accept(debounce_key *k, unsigned long long timestamp){
+    k->state = k->raw;
+    k->edge_us = timestamp;
+    return 1;
+}
+
+/*
+    Feed a raw sample for a key, returns 1 if the debounced state changed.
+    Keys whose raw and debounced state differ must keep being fed until
+    they settle, even if the raw sample doesn't change again.
+*/
+int debounce_update(unsigned short key_index, unsigned short raw, unsigned long long now){
+    debounce_key *k = &debounce_keys[key_index];
+    int raw_edge = raw != k->raw;
+
+    if(raw_edge){
+        k->raw = raw;
+        k->raw_us = now;
+    }
+
+    if(raw == k->state){
+        // Went back before the change was accepted
+        if(raw_edge && (k->mode == DEBOUNCE_DEFER || k->mode == DEBOUNCE_ASYMMETRIC)){
+            k->rejected++;
+        }
+        return 0;
+    }
+
+    switch(k->mode){
+        case DEBOUNCE_EAGER:
+            if(now - k->edge_us < (k->state ? k->press_us : k->release_us)){
+                if(raw_edge) k->rejected++;
+                return 0;
+            }
+            return accept(k, k->raw_us);
+        case DEBOUNCE_ASYMMETRIC:
+            if(raw) return accept(k, k->raw_us);
+            // Releases are deferred
+        case DEBOUNCE_DEFER:
+            if(now - k->raw_us < (raw ? k->press_us : k->release_us)){
+                return 0;
+            }
+            return accept(k, k->raw_us);
+        default:
+            return accept(k, now);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#define DEBOUNCE_NONE       0
+#define DEBOUNCE_EAGER      1 // Report the first edge, then ignore the key for a lockout window
+#define DEBOUNCE_DEFER      2 // Report an edge once the key has been stable for the settle time
+#define DEBOUNCE_ASYMMETRIC 3 // Eager on press, deferred on release
+
+#define DEBOUNCE_DEFAULT_MODE DEBOUNCE_EAGER
+#define DEBOUNCE_DEFAULT_MS   5
+
+typedef struct debounce_key {
+    unsigned char mode;
+    unsigned int press_us;
+    unsigned int release_us;
+    unsigned short state;              // Debounced state, as seen by Lua
+    unsigned short raw;                // Last raw sample
+    unsigned long long raw_us;         // When the raw sample last changed
+    unsigned long long edge_us;        // When the debounced state last changed
+    unsigned long rejected;            // Bounces filtered out
+} debounce_key;
+
+debounce_key debounce_keys[NUM_KEYS];
+
+void debounce_init();
+void debounce_set(unsigned short key_index, unsigned char mode, unsigned int press_ms, unsigned int release_ms);
+int debounce_update(unsigned short key_index, unsigned short raw, unsigned long long now);
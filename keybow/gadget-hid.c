@@ -1,4 +1,5 @@
 #include "gadget-hid.h"
+#include "usb-config.h"
 #include <errno.h>
 #include <stdio.h>
 #include <linux/usb/ch9.h>
@@ -58,6 +59,73 @@ static char report_desc[] = {
 
     0xC0,       // END_COLLECTION
 
+    //             N-Key Rollover Keyboard
+
+    0x05, 0x01, // USAGE_PAGE (Generic Desktop)
+    0x09, 0x06, // USAGE (Keyboard)
+    0xA1, 0x01, // COLLECTION (Application)
+
+    0x85, 0x03, //   REPORT_ID (3)
+
+    0x05, 0x07, //   USAGE_PAGE (Key Codes)
+    0x19, 0xE0, //   USAGE_MINIMUM (224)
+    0x29, 0xE7, //   USAGE_MAXIMUM (231)
+    0x15, 0x00, //   LOGICAL_MINIMUM (0)
+    0x25, 0x01, //   LOGICAL_MAXIMUM (1)
+    0x75, 0x01, //   REPORT_SIZE (1)
+    0x95, 0x08, //   REPORT_COUNT (8)
+    0x81, 0x02, //   INPUT (Data, Variable, Absolute)
+
+    0x19, 0x00, //   USAGE_MINIMUM (0)
+    0x29, 0xFF, //   USAGE_MAXIMUM (255)
+    0x96, 0x00, 0x01, // REPORT_COUNT (256)
+    0x75, 0x01, //   REPORT_SIZE (1)
+    0x81, 0x02, //   INPUT (Data, Variable, Absolute)
+
+    0xC0,       // END_COLLECTION
+
+    //             Mouse
+
+    0x05, 0x01, // USAGE_PAGE (Generic Desktop)
+    0x09, 0x02, // USAGE (Mouse)
+    0xA1, 0x01, // COLLECTION (Application)
+
+    0x85, 0x04, //   REPORT_ID (4)
+
+    0x09, 0x01, //   USAGE (Pointer)
+    0xA1, 0x00, //   COLLECTION (Physical)
+
+    0x05, 0x09, //     USAGE_PAGE (Button)
+    0x19, 0x01, //     USAGE_MINIMUM (1)
+    0x29, 0x05, //     USAGE_MAXIMUM (5)
+    0x15, 0x00, //     LOGICAL_MINIMUM (0)
+    0x25, 0x01, //     LOGICAL_MAXIMUM (1)
+    0x95, 0x05, //     REPORT_COUNT (5)
+    0x75, 0x01, //     REPORT_SIZE (1)
+    0x81, 0x02, //     INPUT (Data, Variable, Absolute)
+
+    0x95, 0x01, //     REPORT_COUNT (1)
+    0x75, 0x03, //     REPORT_SIZE (3)
+    0x81, 0x01, //     INPUT (Constant)
+
+    0x05, 0x01, //     USAGE_PAGE (Generic Desktop)
+    0x09, 0x30, //     USAGE (X)
+    0x09, 0x31, //     USAGE (Y)
+    0x09, 0x38, //     USAGE (Wheel)
+    0x15, 0x81, //     LOGICAL_MINIMUM (-127)
+    0x25, 0x7F, //     LOGICAL_MAXIMUM (127)
+    0x75, 0x08, //     REPORT_SIZE (8)
+    0x95, 0x03, //     REPORT_COUNT (3)
+    0x81, 0x06, //     INPUT (Data, Variable, Relative)
+
+    0x05, 0x0C, //     USAGE_PAGE (Consumer)
+    0x0A, 0x38, 0x02, // USAGE (AC Pan)
+    0x95, 0x01, //     REPORT_COUNT (1)
+    0x81, 0x06, //     INPUT (Data, Variable, Relative)
+
+    0xC0,       //   END_COLLECTION
+    0xC0,       // END_COLLECTION
+
     //             Media Keys
 
     0x05, 0x0C, // USAGE_PAGE (Conumer)
@@ -88,6 +156,26 @@ static char report_desc[] = {
     0xC0        // END_COLLECTION
 };
 
+/*
+    libusbgx has no attribute for the interrupt endpoint's bInterval,
+    kernels whose f_hid exposes one get it written straight to configfs.
+    High speed intervals are 2^(bInterval-1) 125us microframes.
+*/
+static void setHIDInterval(unsigned int interval_us){
+    int b_interval = 1;
+    while(b_interval < 16 && (125u << b_interval) <= interval_us){
+        b_interval++;
+    }
+
+    FILE *fp = fopen(HID_INTERVAL_ATTR, "w");
+    if(fp == NULL){
+        printf("HID endpoint interval is fixed by the kernel, pacing reports at %dus\n", interval_us);
+        return;
+    }
+    fprintf(fp, "%d\n", b_interval);
+    fclose(fp);
+}
+
 int initUSB() {
     int ret = -EINVAL;
     int usbg_ret;
@@ -116,10 +204,10 @@ int initUSB() {
     struct usbg_f_midi_attrs midi_attrs = {
         .index = 1,
         .id = "usb1",
-        .buflen = 128,
-        .qlen = 16,
-        .in_ports = 1,
-        .out_ports = 1
+        .buflen = usb_settings.midi_buflen,
+        .qlen = usb_settings.midi_qlen,
+        .in_ports = usb_settings.midi_ports,
+        .out_ports = usb_settings.midi_ports
     };
 
     struct usbg_f_hid_attrs f_attrs = {
@@ -128,7 +216,7 @@ int initUSB() {
             .desc = report_desc,
             .len = sizeof(report_desc),
         },
-        .report_length = 16,
+        .report_length = usb_settings.hid_report_length,
         .subclass = 0,
     };
 
@@ -164,6 +252,8 @@ int initUSB() {
         goto out2;
     }
 
+    setHIDInterval(usb_settings.hid_interval_us);
+
     usbg_ret = usbg_create_function(g, USBG_F_MIDI, "usb0", &midi_attrs, &f_midi);
     if (usbg_ret != USBG_SUCCESS) {
         fprintf(stderr, "Error creating function: USBG_F_MIDI\n");
@@ -4,7 +4,10 @@
 
 #define VENDOR          0x1d6b
 #define PRODUCT         0x0104
-#define HID_REPORT_SIZE 16
+#define HID_REPORT_SIZE 16      // Boot compatible: id, modifiers, padding, 13 keys
+#define HID_BOOT_KEYS   13
+#define HID_NKRO_REPORT_SIZE 34 // N-key rollover: id, modifiers, 256 bit usage bitmap
+#define HID_INTERVAL_ATTR "/sys/kernel/config/usb_gadget/g1/functions/hid.usb0/interval"
 
 usbg_state *s;
 usbg_gadget *g;
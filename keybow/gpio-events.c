@@ -0,0 +1,192 @@
+#include "gpio-events.h"
+#include "keybow.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <linux/gpio.h>
+
+/*
+    Edge triggered key scanning.
+
+    Every key pin is requested from the gpiochip character device with
+    both edges armed, the main loop then sleeps in poll() until one of
+    them fires instead of waking up every millisecond.
+
+    Building with KEYBOW_GPIO_FIFO swaps the gpiochip for a named pipe,
+    so the wake up path can be exercised without a board attached:
+
+        echo "3 1" > /tmp/keybow-gpio    # key 3 pressed
+        echo "3 0" > /tmp/keybow-gpio    # key 3 released
+*/
+
+static struct pollfd event_fds[NUM_KEYS + 1];
+static int num_event_fds = 0;
+static int wake_fd = -1;
+
+/* Lets another thread break gpio_events_wait() out of its sleep */
+static int add_wake_fd(){
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(wake_fd == -1){
+        gpio_events_close();
+        return 1;
+    }
+    event_fds[num_event_fds].fd = wake_fd;
+    event_fds[num_event_fds].events = POLLIN;
+    num_event_fds++;
+    return 0;
+}
+
+#ifdef KEYBOW_GPIO_FIFO
+static uint32_t stub_levels = 0xffffffff; // Pulled up, nothing pressed
+static char stub_line[32];
+static int stub_line_len = 0;
+
+void gpio_events_set_key(unsigned short key_index, unsigned short pressed){
+    if(key_index >= NUM_KEYS) return;
+    keybow_key key = get_key(key_index);
+    if(pressed){
+        stub_levels &= ~(1 << key.gpio_bcm);
+    } else {
+        stub_levels |= (1 << key.gpio_bcm);
+    }
+}
+
+static void stub_parse_line(){
+    int index, pressed;
+    stub_line[stub_line_len] = '\0';
+    stub_line_len = 0;
+    if(sscanf(stub_line, "%d %d", &index, &pressed) != 2) return;
+    if(index < 0) return;
+    gpio_events_set_key(index, pressed);
+}
+
+int gpio_events_init(){
+    if(mkfifo(KEYBOW_GPIO_FIFO, 0666) != 0 && errno != EEXIST){
+        printf("Error creating %s\n", KEYBOW_GPIO_FIFO);
+        return 1;
+    }
+    // Opened read/write so poll() never sees a hangup between writers
+    int fd = open(KEYBOW_GPIO_FIFO, O_RDWR | O_NONBLOCK);
+    if(fd == -1){
+        printf("Error opening %s\n", KEYBOW_GPIO_FIFO);
+        return 1;
+    }
+    event_fds[0].fd = fd;
+    event_fds[0].events = POLLIN;
+    num_event_fds = 1;
+    printf("Simulating key edges on %s\n", KEYBOW_GPIO_FIFO);
+    return add_wake_fd();
+}
+
+static void drain_events(){
+    char c;
+    if(!(event_fds[0].revents & POLLIN)) return;
+    while(read(event_fds[0].fd, &c, 1) == 1){
+        if(c == '\n'){
+            stub_parse_line();
+        } else if(stub_line_len < (int)sizeof(stub_line) - 1){
+            stub_line[stub_line_len++] = c;
+        }
+    }
+}
+
+uint32_t gpio_events_levels(){
+    return stub_levels;
+}
+#else
+int gpio_events_init(){
+    int chip = open(KEYBOW_GPIOCHIP, O_RDONLY);
+    if(chip == -1){
+        printf("Error opening %s\n", KEYBOW_GPIOCHIP);
+        return 1;
+    }
+
+    int x;
+    for(x = 0; x < NUM_KEYS; x++){
+        keybow_key key = get_key(x);
+        struct gpioevent_request req;
+        memset(&req, 0, sizeof(req));
+        req.lineoffset = key.gpio_bcm;
+        req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+        req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+        strncpy(req.consumer_label, "keybow", sizeof(req.consumer_label) - 1);
+
+        if(ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req) == -1){
+            printf("Error requesting edge events for GPIO %d\n", key.gpio_bcm);
+            close(chip);
+            gpio_events_close();
+            return 1;
+        }
+        fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+        event_fds[num_event_fds].fd = req.fd;
+        event_fds[num_event_fds].events = POLLIN;
+        num_event_fds++;
+    }
+
+    close(chip);
+    return add_wake_fd();
+}
+
+static void drain_events(){
+    int x;
+    struct gpioevent_data event;
+    for(x = 0; x < num_event_fds - 1; x++){
+        if(!(event_fds[x].revents & POLLIN)) continue;
+        while(read(event_fds[x].fd, &event, sizeof(event)) == sizeof(event)){}
+    }
+}
+
+/*
+    Snapshot of the whole GPLEV0 bank, every key pin is below 32
+    so a single register read samples all of them at once.
+*/
+uint32_t gpio_events_levels(){
+    return bcm2835_peri_read(bcm2835_gpio + BCM2835_GPLEV0/4);
+}
+#endif
+
+/*
+    Sleep until a key changes or timeout_ms elapses, -1 waits forever.
+    Returns 1 when woken by an edge, 0 on timeout or signal.
+*/
+int gpio_events_wait(int timeout_ms){
+    if(num_event_fds == 0){
+        // Never set up, so nothing would ever wake us. Fall back to polling.
+        usleep(1000);
+        return 0;
+    }
+    int ret = poll(event_fds, num_event_fds, timeout_ms);
+    if(ret <= 0){
+        return 0;
+    }
+
+    if(event_fds[num_event_fds - 1].revents & POLLIN){
+        uint64_t count;
+        read(wake_fd, &count, sizeof(count));
+        if(ret == 1) return 0;
+    }
+
+    drain_events();
+    return 1;
+}
+
+void gpio_events_wake(){
+    uint64_t one = 1;
+    if(wake_fd != -1) write(wake_fd, &one, sizeof(one));
+}
+
+void gpio_events_close(){
+    int x;
+    for(x = 0; x < num_event_fds; x++){
+        close(event_fds[x].fd);
+    }
+    num_event_fds = 0;
+    wake_fd = -1;
+}
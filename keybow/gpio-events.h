@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef KEYBOW_GPIOCHIP
+#define KEYBOW_GPIOCHIP "/dev/gpiochip0"
+#endif
+
+#define SCAN_MODE_POLL 0
+#define SCAN_MODE_EDGE 1
+
+int scan_mode;
+
+int gpio_events_init();
+int gpio_events_wait(int timeout_ms);
+uint32_t gpio_events_levels();
+void gpio_events_wake();
+void gpio_events_set_key(unsigned short key_index, unsigned short pressed);
+void gpio_events_close();
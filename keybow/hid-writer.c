@@ -0,0 +1,126 @@
+#include "hid-writer.h"
+#include "latency.h"
+#include "lights.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+static hid_report queue[HID_WRITER_QUEUE_SIZE];
+static unsigned int queue_head = 0;
+static unsigned int queue_tail = 0;
+static int queue_running = 0;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+static pthread_t t_hid_writer;
+static int writer_fd = -1;
+static unsigned int writer_interval_us = HID_REPORT_INTERVAL_US;
+
+static void write_report(const hid_report *report){
+    int attempt;
+    for(attempt = 0; ; attempt++){
+        int written = write(writer_fd, report->data, report->length);
+        if(written == report->length){
+            __atomic_add_fetch(&hid_stats.sent, 1, __ATOMIC_RELAXED);
+            if(report->edge_us) latency_record(LATENCY_REPORT, micros() - report->edge_us);
+            return;
+        }
+        // A short write has already sent part of the report, errno means nothing then
+        if(written >= 0 || (errno != EAGAIN && errno != EINTR) || attempt == HID_WRITER_RETRIES){
+            __atomic_add_fetch(&hid_stats.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        // The host hasn't picked up the last report yet
+        __atomic_add_fetch(&hid_stats.retried, 1, __ATOMIC_RELAXED);
+        struct pollfd pfd = {.fd = writer_fd, .events = POLLOUT};
+        poll(&pfd, 1, HID_WRITER_TIMEOUT_MS);
+    }
+}
+
+static void *run_hid_writer(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    unsigned long long next_us = 0;
+    hid_report report;
+
+    while(1){
+        pthread_mutex_lock(&queue_mutex);
+        while(queue_head == queue_tail && queue_running){
+            pthread_cond_wait(&queue_not_empty, &queue_mutex);
+        }
+        if(queue_head == queue_tail){
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        report = queue[queue_tail % HID_WRITER_QUEUE_SIZE];
+        queue_tail++;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_mutex);
+
+        // No point handing the gadget reports faster than the host polls for them
+        unsigned long long now = micros();
+        if(now < next_us) usleep(next_us - now);
+
+        write_report(&report);
+        next_us = micros() + writer_interval_us;
+    }
+    return NULL;
+}
+
+void hid_writer_init(int fd){
+    writer_fd = fd;
+    memset(&hid_stats, 0, sizeof(hid_stats));
+}
+
+int hid_writer_start(unsigned int interval_us){
+    writer_interval_us = interval_us;
+    queue_running = 1;
+    if(pthread_create(&t_hid_writer, NULL, run_hid_writer, NULL)){
+        printf("Error creating HID writer thread.\n");
+        queue_running = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Blocks while the queue is full, so long macros are paced rather than dropped */
+void hid_writer_queue(const unsigned char *data, int length, unsigned long long edge_us){
+    hid_report report;
+    if(length > HID_WRITER_MAX_REPORT) length = HID_WRITER_MAX_REPORT;
+    report.length = length;
+    report.edge_us = edge_us;
+    memcpy(report.data, data, length);
+
+    pthread_mutex_lock(&queue_mutex);
+    if(!queue_running){
+        pthread_mutex_unlock(&queue_mutex);
+        write_report(&report);
+        return;
+    }
+    while(queue_head - queue_tail >= HID_WRITER_QUEUE_SIZE){
+        pthread_cond_wait(&queue_not_full, &queue_mutex);
+    }
+    queue[queue_head % HID_WRITER_QUEUE_SIZE] = report;
+    queue_head++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/* Writes out anything still queued, then stops the writer thread */
+void hid_writer_stop(){
+    pthread_mutex_lock(&queue_mutex);
+    if(!queue_running){
+        pthread_mutex_unlock(&queue_mutex);
+        return;
+    }
+    queue_running = 0;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(t_hid_writer, NULL);
+}
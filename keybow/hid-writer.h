@@ -0,0 +1,40 @@
+#pragma once
+
+#include <pthread.h>
+
+/*
+    Queues HID reports for a dedicated writer thread, which waits for
+    /dev/hidg0 to become writable and paces reports by the endpoint
+    interval. Until hid_writer_start() is called reports are written
+    synchronously to the fd given to hid_writer_init(), which is what
+    trace replays rely on.
+*/
+
+#define HID_WRITER_QUEUE_SIZE 64
+#define HID_WRITER_MAX_REPORT 64
+#define HID_WRITER_RETRIES 10
+#define HID_WRITER_TIMEOUT_MS 100
+
+#ifndef HID_REPORT_INTERVAL_US
+#define HID_REPORT_INTERVAL_US 1000
+#endif
+
+typedef struct hid_report {
+    unsigned char length;
+    unsigned char data[HID_WRITER_MAX_REPORT];
+    unsigned long long edge_us; // Key event that caused this report, for latency tracking
+} hid_report;
+
+typedef struct hid_writer_stats {
+    unsigned long sent;
+    unsigned long retried;  // Writes that hit EAGAIN and had to wait for the host
+    unsigned long dropped;  // Writes that failed for good
+    unsigned long suppressed; // Keyboard reports identical to the last one, never queued
+} hid_writer_stats;
+
+hid_writer_stats hid_stats;
+
+void hid_writer_init(int fd);
+int hid_writer_start(unsigned int interval_us);
+void hid_writer_queue(const unsigned char *data, int length, unsigned long long edge_us);
+void hid_writer_stop();
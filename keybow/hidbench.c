@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    Measures how many keyboard reports per second get through the gadget.
+
+    With dummy_hcd loaded the gadget enumerates on the Pi's own host
+    side, so both ends can be watched without a second machine:
+
+        modprobe dummy_hcd
+        ./keybow-usbtest &                       # or anything binding hid.usb0
+        ./hidbench /dev/hidg0 /dev/hidraw0 5000
+
+    Reports alternate between pressing and releasing a key, and are
+    written as fast as /dev/hidg0 accepts them. A second thread drains
+    the host side hidraw node, so the rate is measured end to end. It
+    is not just how fast the gadget driver can buffer reports. Without
+    a hidraw node only the gadget side is measured, which is only
+    meaningful if something else is reading the host side.
+*/
+
+#define REPORT_SIZE 16
+
+static int reports_read = 0;
+static int reading = 1;
+static unsigned long long last_read_us = 0;
+
+static unsigned long long now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void *run_reader(void *void_ptr){
+    int fd = *(int *)void_ptr;
+    unsigned char buf[64];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while(__atomic_load_n(&reading, __ATOMIC_RELAXED)){
+        // Time out now and then to notice the benchmark is over
+        if(poll(&pfd, 1, 100) <= 0) continue;
+        if(read(fd, buf, sizeof(buf)) > 0){
+            __atomic_add_fetch(&reports_read, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&last_read_us, now_us(), __ATOMIC_RELAXED);
+        }
+        else if(pfd.revents & (POLLERR | POLLHUP)){
+            break; // The device went away
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *gadget = argc > 1 ? argv[1] : "/dev/hidg0";
+    const char *host = argc > 2 ? argv[2] : NULL;
+    int count = argc > 3 ? atoi(argv[3]) : 5000;
+    pthread_t t_reader;
+    int host_fd = -1;
+
+    int hid_fd = open(gadget, O_WRONLY);
+    if(hid_fd == -1){
+        printf("Error opening %s for writing.\n", gadget);
+        return 1;
+    }
+
+    if(host != NULL){
+        host_fd = open(host, O_RDONLY | O_NONBLOCK);
+        if(host_fd == -1){
+            printf("Error opening %s for reading.\n", host);
+            return 1;
+        }
+        pthread_create(&t_reader, NULL, run_reader, &host_fd);
+    }
+
+    unsigned char report[REPORT_SIZE];
+    unsigned long long worst_us = 0;
+    unsigned long long total_us = 0;
+    int failed = 0;
+    int x;
+
+    memset(report, 0, sizeof(report));
+    report[0] = 1; // report id
+
+    unsigned long long start = now_us();
+    for(x = 0; x < count; x++){
+        report[3] = (x & 1) ? 0 : 0x04; // a, pressed then released
+        unsigned long long t = now_us();
+        if(write(hid_fd, report, REPORT_SIZE) != REPORT_SIZE){
+            failed++;
+            continue;
+        }
+        t = now_us() - t;
+        total_us += t;
+        if(t > worst_us) worst_us = t;
+    }
+    unsigned long long elapsed = now_us() - start;
+
+    if(host_fd != -1){
+        usleep(100000); // Let the last few reports arrive
+        __atomic_store_n(&reading, 0, __ATOMIC_RELAXED);
+        pthread_join(t_reader, NULL);
+        close(host_fd);
+    }
+    close(hid_fd);
+
+    int written = count - failed;
+    printf("Wrote %d reports in %llums, %d failed\n", written, elapsed / 1000, failed);
+    if(written > 0){
+        printf("Write: %.1f reports/s, avg %lluus, worst %lluus\n",
+            written * 1000000.0 / elapsed, total_us / written, worst_us);
+    }
+    if(host != NULL && last_read_us > start){
+        printf("Read: %d reports, %.1f reports/s\n",
+            reports_read, reports_read * 1000000.0 / (last_read_us - start));
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "host-leds.h"
+#include "key-ring.h"
+#include "lights.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+static pthread_t t_host_leds;
+static int reader_fd = -1;
+static int wake_fd = -1;
+static unsigned char leds_state = 0;
+static int leds_pending = 0;
+
+#ifdef KEYBOW_HOST_LEDS_FIFO
+static char stub_line[16];
+static int stub_line_len = 0;
+
+static int open_reader(int fd){
+    if(mkfifo(KEYBOW_HOST_LEDS_FIFO, 0666) != 0 && errno != EEXIST){
+        printf("Error creating %s\n", KEYBOW_HOST_LEDS_FIFO);
+        return -1;
+    }
+    printf("Simulating host LEDs on %s\n", KEYBOW_HOST_LEDS_FIFO);
+    return open(KEYBOW_HOST_LEDS_FIFO, O_RDWR | O_NONBLOCK);
+}
+
+/* Returns the last complete line's value, or -1 */
+static int read_leds(){
+    char c;
+    int leds = -1;
+    while(read(reader_fd, &c, 1) == 1){
+        if(c == '\n'){
+            stub_line[stub_line_len] = '\0';
+            leds = atoi(stub_line) & 0xff;
+            stub_line_len = 0;
+        } else if(stub_line_len < (int)sizeof(stub_line) - 1){
+            stub_line[stub_line_len++] = c;
+        }
+    }
+    return leds;
+}
+#else
+static int open_reader(int fd){
+    return fd;
+}
+
+/*
+    Output reports carry the report id first when the descriptor has
+    more than one report, the LED bits follow it.
+*/
+static int read_leds(){
+    unsigned char report[64];
+    int leds = -1;
+    int length;
+    while((length = read(reader_fd, report, sizeof(report))) > 0){
+        if(length >= 2 && report[0] == 1){
+            leds = report[1];
+        } else if(length == 1){
+            leds = report[0];
+        }
+    }
+    return leds;
+}
+#endif
+
+static void *run_host_leds(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct pollfd pfds[2] = {
+        {.fd = reader_fd, .events = POLLIN},
+        {.fd = wake_fd, .events = POLLIN}
+    };
+
+    while(1){
+        if(poll(pfds, 2, -1) <= 0){
+            continue;
+        }
+        if(pfds[1].revents & POLLIN){
+            break;
+        }
+        if(pfds[0].revents & (POLLERR | POLLHUP)){
+            break;
+        }
+        int leds = read_leds();
+        if(leds == -1 || leds == __atomic_load_n(&leds_state, __ATOMIC_RELAXED)){
+            continue;
+        }
+        __atomic_store_n(&leds_state, leds, __ATOMIC_RELAXED);
+        __atomic_store_n(&leds_pending, 1, __ATOMIC_RELEASE);
+        lights_setHostLeds(leds);
+        key_ring_notify(&key_events);
+    }
+    return NULL;
+}
+
+int host_leds_start(int fd){
+    reader_fd = open_reader(fd);
+    if(reader_fd == -1){
+        printf("Error opening host LED reports\n");
+        return 1;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(wake_fd == -1){
+        return 1;
+    }
+    fcntl(reader_fd, F_SETFL, fcntl(reader_fd, F_GETFL) | O_NONBLOCK);
+    if(pthread_create(&t_host_leds, NULL, run_host_leds, NULL)){
+        printf("Error creating host LED thread.\n");
+        close(wake_fd);
+        wake_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+unsigned char host_leds_get(){
+    return __atomic_load_n(&leds_state, __ATOMIC_RELAXED);
+}
+
+/* Lua thread side. Returns 1, and the new state, if it changed since the last call */
+int host_leds_take(unsigned char *leds){
+    if(!__atomic_exchange_n(&leds_pending, 0, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+    *leds = host_leds_get();
+    return 1;
+}
+
+void host_leds_stop(){
+    uint64_t one = 1;
+    if(wake_fd == -1) return;
+    write(wake_fd, &one, sizeof(one));
+    pthread_join(t_host_leds, NULL);
+    close(wake_fd);
+    wake_fd = -1;
+#ifdef KEYBOW_HOST_LEDS_FIFO
+    close(reader_fd);
+#endif
+    reader_fd = -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+    Keyboard LED state (Num/Caps/Scroll Lock...) from the output reports
+    the host sends to /dev/hidg0. A reader thread sleeps in poll() on the
+    gadget and wakes the Lua thread through the key ring when it changes.
+
+    Building with KEYBOW_HOST_LEDS_FIFO reads "<bits>" lines from a named
+    pipe instead, so LED changes can be simulated without a host:
+
+        echo 2 > /tmp/keybow-leds    # Caps Lock on
+*/
+
+#define HOST_LED_NUM_LOCK    0
+#define HOST_LED_CAPS_LOCK   1
+#define HOST_LED_SCROLL_LOCK 2
+#define HOST_LED_COMPOSE     3
+#define HOST_LED_KANA        4
+
+int host_leds_start(int fd);
+unsigned char host_leds_get();
+int host_leds_take(unsigned char *leds);
+void host_leds_stop();
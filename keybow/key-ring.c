@@ -0,0 +1,75 @@
+#include "key-ring.h"
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+int key_ring_init(key_ring *ring){
+    ring->head = 0;
+    ring->tail = 0;
+    ring->overflows = 0;
+    ring->notify_fd = eventfd(0, EFD_NONBLOCK);
+    if(ring->notify_fd == -1){
+        printf("Error creating key event notifier\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Producer side. Returns 0 and counts an overflow if the ring is full */
+int key_ring_push(key_ring *ring, const key_event *event){
+    unsigned int head = ring->head;
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if(head - tail >= KEY_RING_SIZE){
+        __atomic_add_fetch(&ring->overflows, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    ring->events[head & (KEY_RING_SIZE - 1)] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    write(ring->notify_fd, &one, sizeof(one));
+    return 1;
+}
+
+/* Consumer side. Returns 0 if the ring is empty */
+int key_ring_pop(key_ring *ring, key_event *event){
+    unsigned int tail = ring->tail;
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if(head == tail){
+        return 0;
+    }
+
+    *event = ring->events[tail & (KEY_RING_SIZE - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+    Consumer side. Sleep until something has been pushed
+    or timeout_ms elapses, -1 waits forever.
+*/
+int key_ring_wait(key_ring *ring, int timeout_ms){
+    struct pollfd pfd = {.fd = ring->notify_fd, .events = POLLIN};
+    if(poll(&pfd, 1, timeout_ms) <= 0){
+        return 0;
+    }
+    uint64_t count;
+    read(ring->notify_fd, &count, sizeof(count));
+    return 1;
+}
+
+/* Wakes key_ring_wait() without an event, for other work the consumer picks up */
+void key_ring_notify(key_ring *ring){
+    uint64_t one = 1;
+    write(ring->notify_fd, &one, sizeof(one));
+}
+
+void key_ring_close(key_ring *ring){
+    close(ring->notify_fd);
+    ring->notify_fd = -1;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+    Single producer, single consumer ring of key events.
+    The scan thread pushes, the Lua thread pops, neither ever blocks.
+*/
+
+#ifndef KEY_RING_SIZE
+#define KEY_RING_SIZE 64 // Must be a power of two
+#endif
+
+typedef struct key_event {
+    unsigned long long timestamp;   // micros() when the transition happened
+    unsigned short key_index;
+    unsigned short state;
+} key_event;
+
+typedef struct key_ring {
+    key_event events[KEY_RING_SIZE];
+    unsigned int head;              // Written by the producer only
+    unsigned int tail;              // Written by the consumer only
+    unsigned long overflows;        // Events dropped because the ring was full
+    int notify_fd;                  // eventfd the consumer can sleep on
+} key_ring;
+
+key_ring key_events;
+
+int key_ring_init(key_ring *ring);
+int key_ring_push(key_ring *ring, const key_event *event);
+int key_ring_pop(key_ring *ring, key_event *event);
+int key_ring_wait(key_ring *ring, int timeout_ms);
+void key_ring_notify(key_ring *ring);
+void key_ring_close(key_ring *ring);
@@ -1,9 +1,24 @@
 #include "keybow.h"
 
 #include "serial.h"
+#include "gpio-events.h"
+#include "debounce.h"
+#include "key-ring.h"
+#include "latency.h"
+#include "trace.h"
+#include "hid-writer.h"
+#include "usb-config.h"
+#include "host-leds.h"
+#include "macro.h"
+#include "mouse.h"
+#include "midi-in.h"
+#include "midi-out.h"
+#include "midi-clock.h"
 
 #ifndef KEYBOW_NO_USB_HID
 #include "gadget-hid.h"
+#include <sys/ioctl.h>
+#include <sound/asound.h>
 #endif
 
 #include "lights.h"
@@ -17,18 +32,25 @@
 #include <lualib.h>
 #include <lauxlib.h>
 #include <unistd.h>
+#include <string.h>
 
 int hid_output;
 int midi_output;
+int midi_ports[MIDI_MAX_PORTS];
 int running = 0;
 int key_index = 0;
 
 pthread_t t_run_lights;
+pthread_t t_run_keys;
 
 void signal_handler(int dummy) {
     running = 0;
 }
 
+void latency_signal_handler(int dummy) {
+    latency_dump_requested = 1;
+}
+
 keybow_key get_key(unsigned short index){
     keybow_key key;
     index *= 3;
@@ -38,6 +60,30 @@ keybow_key get_key(unsigned short index){
     return key;
 }
 
+#ifndef KEYBOW_NO_USB_HID
+/*
+    Every port of the MIDI function is a subdevice of the same rawmidi
+    device. Which one open() hands out is chosen the way alsa-lib does
+    it, by setting a preference on the card's control device first.
+*/
+int openMIDIPort(int port){
+    int fd;
+    int ctl = open("/dev/snd/controlC1", O_RDWR);
+    if (ctl == -1) {
+        return -1;
+    }
+    if (ioctl(ctl, SNDRV_CTL_IOCTL_RAWMIDI_PREFER_SUBDEVICE, &port) == -1) {
+        close(ctl);
+        return -1;
+    }
+    do {
+        fd = open("/dev/snd/midiC1D0", O_RDWR | O_NDELAY); // Read for notes and clock from the host
+    } while (fd == -1 && errno == EINTR);
+    close(ctl);
+    return fd;
+}
+#endif
+
 void add_key(unsigned short gpio_bcm, unsigned short hid_code, unsigned short led_index){
     mapping_table[(key_index * 3) + 0] = gpio_bcm;
     mapping_table[(key_index * 3) + 1] = hid_code;
@@ -46,10 +92,19 @@ void add_key(unsigned short gpio_bcm, unsigned short hid_code, unsigned short le
 }
 
 int initGPIO() {
+    int x = 0;
+    key_mask = 0;
+    for(x = 0; x < NUM_KEYS; x++){
+        keybow_key key = get_key(x);
+        key_mask |= (1 << key.gpio_bcm);
+        pin_to_key[key.gpio_bcm] = x;
+    }
+#ifdef KEYBOW_GPIO_FIFO
+    return 0; // Key levels come from the simulated pipe
+#endif
     if (!bcm2835_init()){
         return 1;
     }
-    int x = 0;
     for(x = 0; x < NUM_KEYS; x++){
         keybow_key key = get_key(x);
         bcm2835_gpio_fsel(key.gpio_bcm, BCM2835_GPIO_FSEL_INPT);
@@ -59,35 +114,147 @@ int initGPIO() {
 }
 
 int updateKeys() {
-    int x = 0;
-    //unsigned short buf[HID_REPORT_SIZE];
-    //for(x = 0; x < HID_REPORT_SIZE; x++){
-    //    buf[x] = 0;
-    //}
-    //int buf_index = 2; // Skip modifier and padding bytes
-    for(x = 0; x < NUM_KEYS; x++){
-        keybow_key key = get_key(x);
-        int state = bcm2835_gpio_lev(key.gpio_bcm) == 0;
-        if(state != last_state[x]){
-            luaHandleKey(x, state);            
+    unsigned long long now = micros();
+    // Keys pull their pin low when pressed
+    uint32_t pressed = ~gpio_events_levels() & key_mask;
+    uint32_t changed = (pressed ^ last_pressed) | unsettled_keys;
+    last_pressed = pressed;
+    unsettled_keys = 0;
+
+    // Hand over changes the ring was too full for last time, or the host never sees the release
+    uint32_t unsent = unsent_keys;
+    while(unsent){
+        int pin = __builtin_ctz(unsent);
+        unsigned short x = pin_to_key[pin];
+        unsent &= unsent - 1;
+        key_event event = {
+            .timestamp = debounce_keys[x].edge_us,
+            .key_index = x,
+            .state = debounce_keys[x].state
+        };
+        if(event.state == last_state[x] || key_ring_push(&key_events, &event)){
+            last_state[x] = event.state;
+            unsent_keys &= ~(1 << pin);
         }
-        last_state[x] = state;
-        //if(state){
-        //    buf[buf_index] = key.hid_code;
-        //    buf_index++;
-        //}
     }
-    /*for(x = 0; x < HID_REPORT_SIZE; x++){
-        printf("0x%02x ", buf[x]);
+
+    while(changed){
+        int pin = __builtin_ctz(changed);
+        unsigned short x = pin_to_key[pin];
+        unsigned short state = (pressed >> pin) & 1;
+        changed &= changed - 1;
+        if(debounce_update(x, state, now)){
+            key_event event = {
+                .timestamp = debounce_keys[x].edge_us,
+                .key_index = x,
+                .state = state
+            };
+            if(key_ring_push(&key_events, &event)){
+                last_state[x] = state;
+                unsent_keys &= ~(1 << pin);
+            }
+            else {
+                unsent_keys |= (1 << pin);
+            }
+        }
+        if(debounce_keys[x].state != state){
+            unsettled_keys |= (1 << pin);
+        }
     }
-    printf("\n");*/
-    //write(hid_output, buf, HID_REPORT_SIZE);
+    // Keep waking up until the main loop has made room
+    unsettled_keys |= unsent_keys;
     return 0;
 }
 
+void *run_keys(void *void_ptr){
+    while(running){
+        updateKeys();
+        if (scan_mode == SCAN_MODE_EDGE) {
+            // Only wake periodically if a key is still bouncing
+            gpio_events_wait(unsettled_keys ? 1 : -1);
+        } else {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+void handleKeyEvents(){
+    key_event event;
+    hidBeginBatch();
+    while(key_ring_pop(&key_events, &event)){
+        trace_write(&event);
+        latency_key_start(event.timestamp);
+        luaHandleKey(event.key_index, event.state);
+        latency_key_end();
+    }
+    hidEndBatch();
+    latency_take_edge(); // Handlers that didn't send a report
+}
+
+#ifdef KEYBOW_GPIO_FIFO
+static void replayStep(){
+    luaTick();
+    updateKeys();
+    handleKeyEvents();
+    luaHandlePatternLoads();
+    midi_out_flush();
+}
+
+/*
+    Push a recorded trace through updateKeys() and the Lua handlers on a
+    simulated clock. Time between transitions is stepped a millisecond at
+    a time while tick() is defined or a key is still settling.
+*/
+int replayTrace(FILE *trace){
+    trace_record record;
+    struct timespec started, finished;
+    unsigned long long next_us = simulated_us;
+    unsigned long events = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    while(trace_read(trace, &record)){
+        next_us += record.delta_us;
+        while(simulated_us < next_us){
+            if(!has_tick && !unsettled_keys){
+                simulated_us = next_us;
+                break;
+            }
+            replayStep();
+            simulated_us += 1000;
+        }
+        gpio_events_set_key(record.key_index, record.state);
+        replayStep();
+        events++;
+    }
+
+    // Let the last transitions settle
+    next_us = simulated_us + 100000;
+    while(simulated_us < next_us){
+        replayStep();
+        simulated_us += 1000;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    fclose(trace);
+
+    printf("Replayed %lu key events, %llums simulated in %lldus\n", events, simulated_us / 1000,
+        (long long)(finished.tv_sec - started.tv_sec) * 1000000 + (finished.tv_nsec - started.tv_nsec) / 1000);
+    return 0;
+}
+#endif
+
 void *run_lights(void *void_ptr){
     while(running){
         int delta = (millis() / (1000/60)) % height;
+        if (lights_frames_per_beat) {
+            midi_clock_state clock;
+            midi_clock_get(micros(), &clock);
+            if (clock.running && clock.locked) {
+                delta = (int)(clock.beat * lights_frames_per_beat) % height;
+            }
+        }
         if (lights_auto) {
             pthread_mutex_lock( &lights_mutex );
             lights_drawPngFrame(delta);
@@ -99,8 +266,33 @@ void *run_lights(void *void_ptr){
     return NULL;
 }
 
-int main() {
+int main(int argc, char **argv) {
     int ret;
+
+#ifdef KEYBOW_GPIO_FIFO
+    /*
+        keybow-test replay <trace> [hid capture] [midi capture]
+        Opened before changing into KEYBOW_HOME so relative paths work.
+    */
+    FILE *replay = NULL;
+    int replay_hid = -1;
+    int replay_midi = -1;
+    if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+        replay = trace_open(argv[2]);
+        if (replay == NULL) {
+            return 1;
+        }
+        replay_hid = open(argc >= 4 ? argv[3] : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        replay_midi = open(argc >= 5 ? argv[4] : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (replay_hid == -1 || replay_midi == -1) {
+            printf("Error opening replay capture files.\n");
+            return 1;
+        }
+        clock_simulated = 1;
+        simulated_us = 0;
+    }
+#endif
+
     chdir(KEYBOW_HOME);
 
     pthread_mutex_init ( &lights_mutex, NULL );
@@ -123,6 +315,10 @@ int main() {
         return 1;
     }
 
+    if (usb_config_load(KEYBOW_USB_CONFIG) != 0) {
+        usb_config_defaults();
+    }
+
 #ifndef KEYBOW_NO_USB_HID
     ret = initUSB();
     //if (ret != 0 && ret != USBG_ERROR_EXIST) {
@@ -130,30 +326,58 @@ int main() {
     //}
 
     do {
-        hid_output = open("/dev/hidg0", O_WRONLY | O_NDELAY);
+        hid_output = open("/dev/hidg0", O_RDWR | O_NDELAY); // Read for host LED reports
     } while (hid_output == -1 && errno == EINTR);
     if (hid_output == -1){
-        printf("Error opening /dev/hidg0 for writing.\n");
+        printf("Error opening /dev/hidg0.\n");
         return 1;
     }
 
-    do {
-        midi_output = open("/dev/snd/midiC1D0", O_WRONLY | O_NDELAY);
-    } while (midi_output == -1 && errno == EINTR);
-    if (midi_output == -1){
-        printf("Error opening /dev/snd/midiC1D0 for writing.\n");
-        return 1;
+    int port;
+    for (port = 0; port < usb_settings.midi_ports; port++) {
+        midi_ports[port] = openMIDIPort(port);
+        if (midi_ports[port] == -1){
+            printf("Error opening /dev/snd/midiC1D0 port %d.\n", port);
+            return 1;
+        }
     }
+    midi_output = midi_ports[0];
 #else
     printf("Opening /dev/null for output.\n");
     hid_output = open("/dev/null", O_WRONLY);
     midi_output = open("/dev/null", O_WRONLY);
+    midi_ports[0] = midi_output;
+#endif
+
+#ifdef KEYBOW_GPIO_FIFO
+    if (replay != NULL) {
+        printf("Capturing replay output.\n");
+        close(hid_output);
+        close(midi_output);
+        hid_output = replay_hid;
+        midi_output = replay_midi;
+    }
 #endif
 
+    hid_writer_init(hid_output);
+    midi_out_init(0, midi_output);
+#ifndef KEYBOW_NO_USB_HID
+    for (port = 1; port < usb_settings.midi_ports; port++) {
+        midi_out_init(port, midi_ports[port]);
+    }
+#endif
+    if (!clock_simulated && hid_writer_start(usb_settings.hid_interval_us) != 0) {
+        return 1;
+    }
+    mouse_init(usb_settings.hid_interval_us);
+
 #ifdef KEYBOW_DEBUG
     printf("Initializing LUA\n");
 #endif
 
+    scan_mode = SCAN_MODE_EDGE;
+    debounce_init();
+
     ret = initLUA();
     if (ret != 0){
         return ret;
@@ -163,6 +387,9 @@ int main() {
     for(x = 0; x < NUM_KEYS; x++){
         last_state[x] = 0;
     }
+    last_pressed = 0;
+    unsettled_keys = 0;
+    unsent_keys = 0;
 
     lights_auto = 1;
 
@@ -174,17 +401,62 @@ int main() {
 
     serial_open();
 
+    if (key_ring_init(&key_events) != 0) {
+        return 1;
+    }
+
+    latency_reset();
+
     printf("Running...\n");
     running = 1;
     signal(SIGINT, signal_handler);
+    signal(SIGUSR1, latency_signal_handler);
 
     luaCallSetup();
 
+#ifdef KEYBOW_GPIO_FIFO
+    if (replay != NULL) {
+        ret = replayTrace(replay);
+        trace_stop();
+        key_ring_close(&key_events);
+        luaClose();
+        close(midi_output);
+        return ret;
+    }
+#endif
+
+    if (scan_mode == SCAN_MODE_EDGE && gpio_events_init() != 0) {
+        printf("Edge detection unavailable, polling keys.\n");
+        scan_mode = SCAN_MODE_POLL;
+    }
+
+    // Worker threads inherit blocked signals, so they always land on this one
+    sigset_t sigint;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    sigaddset(&sigint, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+
     if(pthread_create(&t_run_lights, NULL, run_lights, NULL)) {
         printf("Error creating lighting thread.\n");
         return 1;
     }
 
+    if(pthread_create(&t_run_keys, NULL, run_keys, NULL)) {
+        printf("Error creating key scanning thread.\n");
+        return 1;
+    }
+
+    if (host_leds_start(hid_output) != 0) {
+        printf("Host LED state unavailable.\n");
+    }
+
+    if (midi_in_start(midi_output) != 0) {
+        printf("MIDI input unavailable.\n");
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &sigint, NULL);
+
     while (running){
         /*int delta = (millis() / (1000/60)) % height;
         if (lights_auto) {
@@ -192,12 +464,47 @@ int main() {
         }
         lights_show();*/
         luaTick();
-        updateKeys();
-        usleep(1000);
+        handleKeyEvents();
+        unsigned char leds;
+        if (host_leds_take(&leds)) {
+            luaHandleHostLeds(leds);
+        }
+        luaHandleMidi();
+        unsigned long beat;
+        if (midi_clock_take_beat(&beat)) {
+            luaHandleBeat(beat);
+        }
+        luaHandlePatternLoads();
+        midi_out_flush(); // Everything this pass sent, in one write
+        lights_publish(); // And every pixel it set, in one frame
+        // Put back whatever is held now that the macro's reports are done
+        if (macro_take_finished()) {
+            invalidateHIDReport();
+            flushHIDReport();
+        }
+        // Only wake periodically if keys.lua wants tick() calls
+        key_ring_wait(&key_events, has_tick ? 1 : -1);
+        if (latency_dump_requested) {
+            latency_dump_requested = 0;
+            latency_dump(KEYBOW_LATENCY_FILE);
+        }
         //usleep(250000);
     }      
 
+    gpio_events_wake();
+    pthread_join(t_run_keys, NULL);
     pthread_join(t_run_lights, NULL);
+    gpio_events_close();
+    host_leds_stop();
+    midi_in_stop();
+
+#ifdef KEYBOW_DEBUG
+    printf("Key events dropped: %lu\n", key_events.overflows);
+    printf("HID reports sent: %lu, retried: %lu, dropped: %lu, suppressed: %lu\n", hid_stats.sent, hid_stats.retried, hid_stats.dropped, hid_stats.suppressed);
+    printf("Light frames sent: %lu, skipped: %lu\n", lights_stats_total.sent, lights_stats_total.skipped);
+#endif
+    key_ring_close(&key_events);
+    trace_stop();
 
     printf("Closing LUA\n");
     luaClose();
@@ -1,5 +1,8 @@
+#pragma once
+
 #include <bcm2835.h>
 #include <pthread.h>
+#include <stdint.h>
 #include "lights.h"
 #include "lua-config.h"
 
@@ -13,6 +16,12 @@ pthread_mutex_t lights_mutex;
 
 unsigned short last_state[NUM_KEYS];
 
+uint32_t key_mask;
+uint32_t last_pressed;
+uint32_t unsettled_keys;
+uint32_t unsent_keys; // Debounced changes the full key ring couldn't take yet
+unsigned short pin_to_key[32];
+
 int lights_auto;
 
 typedef struct keybow_key {
@@ -24,7 +33,8 @@ typedef struct keybow_key {
 unsigned short mapping_table[36];
 
 void *run_lights(void *void_ptr);
+void *run_keys(void *void_ptr);
 keybow_key get_key(unsigned short index);
 int initUSB();
 int initGPIO();
-int main();
+int main(int argc, char **argv);
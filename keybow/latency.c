@@ -0,0 +1,98 @@
+#include "latency.h"
+#include "lights.h"
+#include <pthread.h>
+
+static const char *stage_names[LATENCY_STAGES] = {
+    "queue",
+    "handler",
+    "report"
+};
+
+// The HID writer thread records into the histograms while Lua reads and resets them
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Edge time of the key event Lua is currently handling, 0 if none
+static unsigned long long current_edge_us = 0;
+static unsigned long long current_enter_us = 0;
+
+void latency_reset(){
+    pthread_mutex_lock(&latency_mutex);
+    memset(latency_stages, 0, sizeof(latency_stages));
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+void latency_record(int stage, unsigned long long us){
+    latency_histogram *h = &latency_stages[stage];
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if(bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    pthread_mutex_lock(&latency_mutex);
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += us;
+    if(us > h->max_us) h->max_us = us;
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+void latency_key_start(unsigned long long edge_us){
+    current_enter_us = micros();
+    // Batched handlers share a report, keep the oldest edge
+    if(current_edge_us == 0) current_edge_us = edge_us;
+    latency_record(LATENCY_QUEUE, current_enter_us - edge_us);
+}
+
+void latency_key_end(){
+    latency_record(LATENCY_HANDLER, micros() - current_enter_us);
+}
+
+/*
+    Edge time to tag a HID report with, so the writer can record
+    LATENCY_REPORT once it's actually written. Only the first report
+    per key event is tagged, 0 means untagged.
+*/
+unsigned long long latency_take_edge(){
+    unsigned long long edge_us = current_edge_us;
+    current_edge_us = 0;
+    return edge_us;
+}
+
+int latency_format(char *out, int length){
+    latency_histogram stages[LATENCY_STAGES];
+    int used = 0;
+    int stage, bucket;
+
+    pthread_mutex_lock(&latency_mutex);
+    memcpy(stages, latency_stages, sizeof(stages));
+    pthread_mutex_unlock(&latency_mutex);
+
+    for(stage = 0; stage < LATENCY_STAGES && used < length; stage++){
+        latency_histogram *h = &stages[stage];
+        used += snprintf(out + used, length - used, "%s: count %lu mean %lluus max %lluus\n",
+            stage_names[stage], h->count,
+            h->count ? h->total_us / h->count : 0, h->max_us);
+        for(bucket = 0; bucket < LATENCY_BUCKETS && used < length; bucket++){
+            if(h->buckets[bucket] == 0) continue;
+            if(bucket == LATENCY_BUCKETS - 1){
+                used += snprintf(out + used, length - used, "  >= %lluus: %lu\n",
+                    1ULL << (bucket - 1), h->buckets[bucket]);
+            } else {
+                used += snprintf(out + used, length - used, "  < %lluus: %lu\n",
+                    1ULL << bucket, h->buckets[bucket]);
+            }
+        }
+    }
+    return used < length ? used : length - 1;
+}
+
+int latency_dump(const char *file_name){
+    char report[2048];
+    int length = latency_format(report, sizeof(report));
+
+    FILE *fd = fopen(file_name, "w");
+    if(fd == NULL){
+        printf("Error opening %s for writing\n", file_name);
+        return 1;
+    }
+    fwrite(report, 1, length, fd);
+    fclose(fd);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+    Key-to-HID latency histograms.
+
+    Bucket 0 holds 0us, bucket n holds [2^(n-1), 2^n)us
+    and the last bucket collects everything slower.
+*/
+
+#define LATENCY_BUCKETS 22
+
+#define LATENCY_QUEUE   0 // Edge detected -> Lua handler entered
+#define LATENCY_HANDLER 1 // Lua handler entered -> exited
+#define LATENCY_REPORT  2 // Edge detected -> first HID report written
+#define LATENCY_STAGES  3
+
+#ifndef KEYBOW_LATENCY_FILE
+#define KEYBOW_LATENCY_FILE "latency.txt"
+#endif
+
+typedef struct latency_histogram {
+    unsigned long buckets[LATENCY_BUCKETS];
+    unsigned long count;
+    unsigned long long total_us;
+    unsigned long long max_us;
+} latency_histogram;
+
+latency_histogram latency_stages[LATENCY_STAGES];
+
+volatile int latency_dump_requested;
+
+void latency_reset();
+void latency_record(int stage, unsigned long long us);
+void latency_key_start(unsigned long long edge_us);
+void latency_key_end();
+unsigned long long latency_take_edge();
+int latency_format(char *out, int length);
+int latency_dump(const char *file_name);
@@ -1,11 +1,61 @@
 #include "lights.h"
 
+static int spi_ready = 0;
+static unsigned char host_leds = 0;
+static int frame_dirty = 1;         // Overlays changed, the frame needs sending again
+
+/*
+    Triple buffered. Writers draw into the back frame and publish it by
+    swapping it with the middle one, the renderer swaps the middle one
+    with the frame it sends, so neither ever waits on the other and
+    the renderer always sends a whole frame.
+*/
+#define FRAME_NEW 4                 // Set in middle when it holds a frame the renderer hasn't taken
+
+static char frames[3][BUF_SIZE];
+static pthread_mutex_t back_mutex = PTHREAD_MUTEX_INITIALIZER; // Only between writers
+static int back = 0;
+static int middle = 1;
+static int front = 2;
+static int back_dirty = 0;
+
+static char *pattern = NULL;        // Every frame of the pattern on show, encoded ready to send
+static int pattern_frames = 0;
+static unsigned long long last_sent_us = 0;
+static unsigned int refresh_ms = LIGHTS_REFRESH_MS;
+
+/* Pixels forced to a colour from outside the lighting thread, eg: by MIDI notes */
+typedef struct overlay_pixel {
+    unsigned char enabled;
+    unsigned char r, g, b;
+} overlay_pixel;
+
+static overlay_pixel overlay[NUM_PIXELS];
+
 unsigned long long millis(){
+    if(clock_simulated) return simulated_us / 1000;
     struct timeval tv;
     gettimeofday(&tv, NULL);
     return (unsigned long long)(tv.tv_sec) * 1000 + (unsigned long long)(tv.tv_usec) / 1000;
 }
 
+/* Monotonic, for timing key transitions */
+unsigned long long micros(){
+    if(clock_simulated) return simulated_us;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)(ts.tv_sec) * 1000000 + (unsigned long long)(ts.tv_nsec) / 1000;
+}
+
+/* Sleeps, or just moves the clock on when replaying a trace */
+void delay_us(unsigned long long us){
+    if(clock_simulated){
+        simulated_us += us;
+        return;
+    }
+    usleep(us);
+}
+
 void abort_(const char * s, ...)
 {
     va_list args;
@@ -16,147 +66,362 @@ void abort_(const char * s, ...)
     // abort();
 }
 
-int read_png_file(char* file_name)
+static void encode_pixel(char *out, int x, png_byte *ptr){
+    out[(x * 4) + 0] = 0b11100011;
+    out[(x * 4) + 1] = ptr[2];
+    out[(x * 4) + 2] = ptr[1];
+    out[(x * 4) + 3] = ptr[0];
+}
+
+/* Everything one decode needs, so patterns can be decoded off the lighting thread */
+typedef struct png_decode {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep *rows;
+    int width, height;
+    int channels;
+} png_decode;
+
+/*
+    Turns the rows of the PNG into APA102 pixel data, one frame after
+    another in LED order, so drawing a frame is a single copy.
+
+    A 4 pixel wide image is a 4x3 grid per frame, anything else has a
+    frame per row with the row wrapped or cut to fit the 12 keys.
+*/
+static char *encode_pattern(png_decode *d, int *frame_count){
+    int count = d->width == 4 ? d->height / 3 : d->height;
+    int f, px, py;
+    if(count < 1 || d->width < 1){
+        abort_("[read_png_file] Image is too small for a pattern");
+        return NULL;
+    }
+
+    char *encoded = malloc(count * PIXEL_DATA_SIZE);
+    if(encoded == NULL){
+        abort_("[read_png_file] Out of memory encoding pattern");
+        return NULL;
+    }
+
+    for(f = 0; f < count; f++){
+        char *out = encoded + (f * PIXEL_DATA_SIZE);
+        if(d->width == 4){
+            for(py = 0; py < 3; py++){
+                png_byte* row = d->rows[(f * 3) + py];
+                for(px = 0; px < 4; px++){
+                    encode_pixel(out, px + (py * 4), &row[px * d->channels]);
+                }
+            }
+        }
+        else {
+            png_byte* row = d->rows[f];
+            for(px = 0; px < NUM_PIXELS; px++){
+                encode_pixel(out, px, &row[(px % d->width) * d->channels]);
+            }
+        }
+    }
+
+    *frame_count = count;
+    return encoded;
+}
+
+/* Frees whatever decoding got as far as allocating */
+static void close_png(png_decode *d, FILE *fp){
+    int row;
+    if (d->rows) {
+        for (row=0; row<d->height; row++)
+            free(d->rows[row]);
+        free(d->rows);
+        d->rows = NULL;
+    }
+    if (d->png_ptr) {
+        png_destroy_read_struct(&d->png_ptr, d->info_ptr ? &d->info_ptr : NULL, NULL);
+        d->png_ptr = NULL;
+        d->info_ptr = NULL;
+    }
+    fclose(fp);
+}
+
+/*
+    Reads a PNG and returns its frames encoded, or NULL. Touches
+    nothing shared, so it's safe to call from any thread.
+*/
+char *lights_encodePng(const char* file_name, int *frame_count, int *image_width, int *image_height)
 {
     unsigned char header[8];    // 8 is the maximum size that can be checked
+    png_decode decode;
+    png_decode *d = &decode;
+    int row;
+
+    memset(d, 0, sizeof(png_decode));
 
     /* open file and test for it being a png */
     FILE *fp = fopen(file_name, "rb");
     if (!fp) {
         abort_("[read_png_file] File %s could not be opened for reading", file_name);
-        return 1;
+        return NULL;
     }
-    fread(header, 1, 8, fp);
-    if (png_sig_cmp(header, 0, 8)) {
+    if (fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8)) {
         abort_("[read_png_file] File %s is not recognized as a PNG file", file_name);
-        return 1;
+        close_png(d, fp);
+        return NULL;
     }
 
     /* initialize stuff */
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    d->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
-    if (!png_ptr) {
+    if (!d->png_ptr) {
         abort_("[read_png_file] png_create_read_struct failed");
-        return 1;
+        close_png(d, fp);
+        return NULL;
     }
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
+    d->info_ptr = png_create_info_struct(d->png_ptr);
+    if (!d->info_ptr) {
         abort_("[read_png_file] png_create_info_struct failed");
-        return 1;
+        close_png(d, fp);
+        return NULL;
     }
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
+    if (setjmp(png_jmpbuf(d->png_ptr))) {
         abort_("[read_png_file] Error during init_io");
-        return 1;
+        close_png(d, fp);
+        return NULL;
     }
 
-    png_init_io(png_ptr, fp);
-    png_set_sig_bytes(png_ptr, 8);
+    png_init_io(d->png_ptr, fp);
+    png_set_sig_bytes(d->png_ptr, 8);
 
-    png_read_info(png_ptr, info_ptr);
+    png_read_info(d->png_ptr, d->info_ptr);
 
-    width = png_get_image_width(png_ptr, info_ptr);
-    height = png_get_image_height(png_ptr, info_ptr);
-    color_type = png_get_color_type(png_ptr, info_ptr);
-    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-    color_channels = png_get_channels(png_ptr, info_ptr);
+    d->width = png_get_image_width(d->png_ptr, d->info_ptr);
+    d->height = png_get_image_height(d->png_ptr, d->info_ptr);
+    d->channels = png_get_channels(d->png_ptr, d->info_ptr);
 
-    number_of_passes = png_set_interlace_handling(png_ptr);
-    png_read_update_info(png_ptr, info_ptr);
+    png_set_interlace_handling(d->png_ptr);
+    png_read_update_info(d->png_ptr, d->info_ptr);
 
 
     /* read file */
-    if (setjmp(png_jmpbuf(png_ptr))) {
+    if (setjmp(png_jmpbuf(d->png_ptr))) {
         abort_("[read_png_file] Error during read_image");
-        return 1;
+        close_png(d, fp);
+        return NULL;
     }
 
-    row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-    for (y=0; y<height; y++)
-        row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
+    d->rows = (png_bytep*) calloc(d->height, sizeof(png_bytep));
+    for (row=0; row<d->height; row++)
+        d->rows[row] = (png_byte*) malloc(png_get_rowbytes(d->png_ptr, d->info_ptr));
 
-    png_read_image(png_ptr, row_pointers);
+    png_read_image(d->png_ptr, d->rows);
 
-    fclose(fp);
+    char *encoded = encode_pattern(d, frame_count);
+    *image_width = d->width;
+    *image_height = d->height;
+    close_png(d, fp);
+    return encoded;
+}
+
+/*
+    Puts a cached pattern on show, the old one plays until now.
+    Called with lights_mutex held, as drawing uses the same frames.
+*/
+void lights_showPattern(pattern_entry *entry){
+    width = entry->width;
+    height = entry->height;
+    pattern = entry->frames;
+    pattern_frames = entry->frame_count;
+    pattern_cache_set_active(entry);
+}
 
+/* Shows a pattern there and then, decoding it only if it isn't already cached */
+int read_png_file(char* file_name)
+{
+    pattern_entry *entry = pattern_cache_find(file_name);
+    if (entry == NULL) {
+        int frame_count, image_width, image_height;
+        char *encoded = lights_encodePng(file_name, &frame_count, &image_width, &image_height);
+        if (encoded == NULL) {
+            return 1;
+        }
+        entry = pattern_cache_insert(file_name, encoded, frame_count, image_width, image_height,
+            frame_count * PIXEL_DATA_SIZE);
+        if (entry == NULL) {
+            return 1;
+        }
+    }
+
+    lights_showPattern(entry);
     return 0;
 }
 
 int initLights() {
     bcm2835_init();
-    bcm2835_spi_begin();
-    bcm2835_spi_set_speed_hz(SPI_SPEED_HZ);
-    bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-    bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
-    bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
-
-    int x;
-    for(x = 0; x < BUF_SIZE; x++){
-        buf[x] = 0;
+    spi_ready = bcm2835_spi_begin(); // Fails off-board, eg: keybow-test on a host
+    if(spi_ready){
+        bcm2835_spi_set_speed_hz(SPI_SPEED_HZ);
+        bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
+        bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
+        bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
     }
 
-    for(x = BUF_SIZE - SOF_BYTES; x < BUF_SIZE; x++){
-        buf[x] = 255;
+    int x, f;
+    for(f = 0; f < 3; f++){
+        for(x = 0; x < BUF_SIZE; x++){
+            frames[f][x] = 0;
+        }
+
+        for(x = BUF_SIZE - SOF_BYTES; x < BUF_SIZE; x++){
+            frames[f][x] = 255;
+        }
     }
 
+    frame_dirty = 1;
+
     return 0;
 }
 
-void lights_setPixel(int x, int r, int g, int b){
+/* Returns 1 if the pixel changed */
+static int set_pixel(char *frame, int x, int r, int g, int b){
     int offset = SOF_BYTES + (x * 4);
-    buf[offset + 0] = 0b11100011;
-    buf[offset + 1] = b;
-    buf[offset + 2] = g;
-    buf[offset + 3] = r;
+    char pixel[4] = {0b11100011, b, g, r};
+    if(memcmp(frame + offset, pixel, 4) == 0) return 0;
+    memcpy(frame + offset, pixel, 4);
+    return 1;
+}
+
+static void mark_dirty(){
+    __atomic_store_n(&frame_dirty, 1, __ATOMIC_RELEASE);
+}
+
+/* Setting a pixel to the colour it already is leaves the frame clean */
+void lights_setPixel(int x, int r, int g, int b){
+    pthread_mutex_lock(&back_mutex);
+    back_dirty |= set_pixel(frames[back], x, r, g, b);
+    pthread_mutex_unlock(&back_mutex);
 }
 
 void lights_setAll(int r, int g, int b){
     int x;
+    pthread_mutex_lock(&back_mutex);
     for(x = 0; x < 12; x++){
-        lights_setPixel(x, r, g, b);
+        back_dirty |= set_pixel(frames[back], x, r, g, b);
+    }
+    pthread_mutex_unlock(&back_mutex);
+}
+
+/*
+    Hands everything drawn since the last call to the renderer at once.
+    Drawing carries on from a copy of the published frame.
+*/
+void lights_publish(){
+    pthread_mutex_lock(&back_mutex);
+    if(back_dirty){
+        int published = back;
+        back = __atomic_exchange_n(&middle, published | FRAME_NEW, __ATOMIC_ACQ_REL) & ~FRAME_NEW;
+        memcpy(frames[back], frames[published], BUF_SIZE);
+        back_dirty = 0;
     }
+    pthread_mutex_unlock(&back_mutex);
 }
 
+void lights_mirrorHostLed(int led, int enabled, int pixel, int r, int g, int b){
+    if(led < 0 || led >= NUM_HOST_LEDS || pixel < 0 || pixel >= NUM_PIXELS) return;
+    host_led_mirrors[led].enabled = 0;
+    host_led_mirrors[led].pixel = pixel;
+    host_led_mirrors[led].r = r;
+    host_led_mirrors[led].g = g;
+    host_led_mirrors[led].b = b;
+    __atomic_store_n(&host_led_mirrors[led].enabled, enabled, __ATOMIC_RELEASE);
+    mark_dirty();
+}
+
+void lights_setOverlay(int pixel, int enabled, int r, int g, int b){
+    if(pixel < 0 || pixel >= NUM_PIXELS) return;
+    __atomic_store_n(&overlay[pixel].enabled, 0, __ATOMIC_RELEASE);
+    overlay[pixel].r = r;
+    overlay[pixel].g = g;
+    overlay[pixel].b = b;
+    __atomic_store_n(&overlay[pixel].enabled, enabled, __ATOMIC_RELEASE);
+    mark_dirty();
+}
+
+void lights_setHostLeds(unsigned char leds){
+    if(__atomic_exchange_n(&host_leds, leds, __ATOMIC_RELAXED) != leds) mark_dirty();
+}
+
+/*
+    Mirrored host LEDs and overlay pixels are drawn over a copy of the
+    frame, so whatever the pattern or Lua put underneath comes back
+    when they go out.
+
+    Nothing is sent unless something changed since the last frame, or
+    the refresh interval has gone by.
+*/
 void lights_show(){
-    bcm2835_spi_writenb(buf, BUF_SIZE);
+    char frame[BUF_SIZE];
+    unsigned long long now = micros();
+    int changed = __atomic_exchange_n(&frame_dirty, 0, __ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&middle, __ATOMIC_ACQUIRE) & FRAME_NEW){
+        front = __atomic_exchange_n(&middle, front, __ATOMIC_ACQ_REL) & ~FRAME_NEW;
+        changed = 1;
+    }
+    char *buf = frames[front];
+    char *out = buf;
+    if(!changed){
+        unsigned int refresh = __atomic_load_n(&refresh_ms, __ATOMIC_RELAXED);
+        if(refresh == 0 || now - last_sent_us < refresh * 1000ULL){
+            lights_stats_total.skipped++;
+            return;
+        }
+    }
+    last_sent_us = now;
+    lights_stats_total.sent++;
+
+    unsigned char leds = __atomic_load_n(&host_leds, __ATOMIC_RELAXED);
+    int x;
+    for(x = 0; x < NUM_HOST_LEDS; x++){
+        host_led_mirror *mirror = &host_led_mirrors[x];
+        if(!(leds & (1 << x)) || !__atomic_load_n(&mirror->enabled, __ATOMIC_ACQUIRE)) continue;
+        if(out == buf){
+            memcpy(frame, buf, BUF_SIZE);
+            out = frame;
+        }
+        set_pixel(frame, mirror->pixel, mirror->r, mirror->g, mirror->b);
+    }
+    for(x = 0; x < NUM_PIXELS; x++){
+        if(!__atomic_load_n(&overlay[x].enabled, __ATOMIC_ACQUIRE)) continue;
+        if(out == buf){
+            memcpy(frame, buf, BUF_SIZE);
+            out = frame;
+        }
+        set_pixel(frame, x, overlay[x].r, overlay[x].g, overlay[x].b);
+    }
+    if(spi_ready) bcm2835_spi_writenb(out, BUF_SIZE);
     usleep(MIN_DELAY_US);
 }
 
+/* 0 never resends an unchanged frame */
+void lights_setRefresh(unsigned int ms){
+    __atomic_store_n(&refresh_ms, ms, __ATOMIC_RELAXED);
+}
+
 void lights_cleanup(){
+    pattern = NULL;
+    pattern_frames = 0;
+    pattern_cache_clear();
     bcm2835_spi_end();
     bcm2835_close();
 }
 
 void lights_drawPngFrame(int frame){
-    if(width == 4){
-    /*
-        4x3xN animation image,
-        each 4x3 area represents a single frame.
-    */
-    frame = (frame % (height / 3)) * 3;
-    for(y = 0; y < 3; y++){
-        png_byte* row = row_pointers[frame + y];
-        for(x = 0; x < 4; x++){
-        png_byte* ptr = &(row[x * color_channels]);
-        lights_setPixel(x + (y * 4), ptr[0], ptr[1], ptr[2]);
-        // printf("x: %d, y: %d, xy: %d  ", x, y, x + (y*4));
-        // printf("r: %d, g: %d, b: %d\n", ptr[0], ptr[1], ptr[2]);
-        }
-    }
-    return;
-    }
-    /* 
-    Other - will try to fit horizontal pixels to keys,
-    wrapping where necessary.
-    each vertical pixel is one frame
-    */
-    frame = frame % height;
-    png_byte* row = row_pointers[frame];
-    for(x = 0; x < 12; x++){
-        int offset = (x % width) * color_channels;
-        png_byte* ptr = &(row[offset]);
-        lights_setPixel(x, ptr[0], ptr[1], ptr[2]);
+    if(pattern_frames == 0) return;
+    char *encoded = pattern + ((frame % pattern_frames) * PIXEL_DATA_SIZE);
+    pthread_mutex_lock(&back_mutex);
+    if(memcmp(frames[back] + SOF_BYTES, encoded, PIXEL_DATA_SIZE) != 0){
+        memcpy(frames[back] + SOF_BYTES, encoded, PIXEL_DATA_SIZE);
+        back_dirty = 1;
     }
-    return;
+    pthread_mutex_unlock(&back_mutex);
+    lights_publish();
 }
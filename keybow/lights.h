@@ -7,38 +7,63 @@
 #include <stdarg.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "pattern-cache.h"
+
 #define NUM_PIXELS 12
 #define SOF_BYTES 4
 #define EOF_BYTES 4
 #define BUF_SIZE ((NUM_PIXELS * 4) + SOF_BYTES + EOF_BYTES)
+#define PIXEL_DATA_SIZE (NUM_PIXELS * 4) // The part of BUF_SIZE that changes
 
 #define SPI_SPEED_HZ 4000000
 #define MIN_DELAY_US 500
+#define LIGHTS_REFRESH_MS 1000  // Resend an unchanged frame this often, in case a pixel glitched
+
+int width, height;              // Of the pattern on show
+
+#define NUM_HOST_LEDS 5
+
+/* A pixel lit in a fixed colour while one of the host's keyboard LEDs is on */
+typedef struct host_led_mirror {
+    unsigned char enabled;
+    unsigned char pixel;
+    unsigned char r, g, b;
+} host_led_mirror;
+
+host_led_mirror host_led_mirrors[NUM_HOST_LEDS];
 
-char buf[BUF_SIZE];
+typedef struct lights_stats {
+    unsigned long sent;         // Frames written to SPI
+    unsigned long skipped;      // Frames left out because nothing changed
+} lights_stats;
 
-int x, y;
+lights_stats lights_stats_total;
 
-int width, height;
-png_byte color_type;
-png_byte bit_depth;
-png_byte color_channels;
+int lights_frames_per_beat;     // Step patterns with the MIDI clock instead of at 60fps, 0 to disable
 
-png_structp png_ptr;
-png_infop info_ptr;
-int number_of_passes;
-png_bytep * row_pointers;
+int clock_simulated;
+unsigned long long simulated_us;
 
 unsigned long long millis();
+unsigned long long micros();
+void delay_us(unsigned long long us);
 void lights_setPixel(int x, int r, int g, int b);
 void lights_setAll(int r, int g, int b);
+void lights_publish();
 void lights_show();
+void lights_setRefresh(unsigned int ms);
+void lights_mirrorHostLed(int led, int enabled, int pixel, int r, int g, int b);
+void lights_setHostLeds(unsigned char leds);
+void lights_setOverlay(int pixel, int enabled, int r, int g, int b);
 void lights_cleanup();
 void lights_drawPngFrame(int frame);
 int read_png_file(char* file_name);
+char *lights_encodePng(const char* file_name, int *frame_count, int *image_width, int *image_height);
+void lights_showPattern(pattern_entry *entry);
 int initLights();
@@ -4,7 +4,7 @@ int main(int argc, char **argv) {
         initLights();
 
         read_png_file(argv[1]);
-        printf("W: %d H: %d D: %d T: %d C: %d\n",width,height,bit_depth,color_type,color_channels);
+        printf("W: %d H: %d\n",width,height);
 
         while (1) {
             int delta = (millis() / (1000/60)) % height;
@@ -3,84 +3,219 @@
 #include "keybow.h"
 #include "gadget-hid.h"
 #include "serial.h"
+#include "gpio-events.h"
+#include "debounce.h"
+#include "key-ring.h"
+#include "latency.h"
+#include "trace.h"
+#include "hid-writer.h"
+#include "ascii-hid.h"
+#include "usb-config.h"
+#include "host-leds.h"
+#include "macro.h"
+#include "mouse.h"
+#include "midi-in.h"
+#include "midi-out.h"
+#include "midi-clock.h"
+#include "sequencer.h"
+#include "pattern-cache.h"
+#include "pattern-loader.h"
+
+#define KEY_BYTE(hid_code) ((hid_code) >> 3)
+#define KEY_BIT(hid_code)  (1 << ((hid_code) & 7))
 
 int isPressed(unsigned short hid_code){
-    int x;
-    for(x = 0; x < 14; x++){
-        if(pressed_keys[x] == hid_code){
-            return 1;
-        }
+    if(hid_code > 0xff) return 0;
+    return (pressed_keys[KEY_BYTE(hid_code)] & KEY_BIT(hid_code)) != 0;
+}
+
+int keyReported(unsigned short hid_code){
+    return (reported_keys[KEY_BYTE(hid_code)] & KEY_BIT(hid_code)) != 0;
+}
+
+/*
+    Batched reports are built from the final state, so a change that
+    undoes one the host hasn't seen yet (eg: the release half of a tap)
+    has to push the pending report out first.
+*/
+void batchCheck(int reported, int current){
+    if(hid_batching && hid_batch_dirty && reported != current){
+        flushHIDReport();
     }
-    return 0;
 }
 
 int releaseKey(unsigned short hid_code){
-    int x;
-    for(x = 0; x < 14; x++){
-        if(pressed_keys[x] == hid_code){
-            pressed_keys[x] = 0;
-            return 1;
-        }
+    if(!isPressed(hid_code)){
+        return 0;
     }
-    return 0;
+    batchCheck(keyReported(hid_code), 1);
+    pressed_keys[KEY_BYTE(hid_code)] &= ~KEY_BIT(hid_code);
+    num_pressed--;
+    return 1;
 }
 
 void pressKey(unsigned short hid_code){
-    int x;
-    for(x = 0; x < 14; x++){
-        if(pressed_keys[x] == 0){
-            pressed_keys[x] = hid_code;
-            return;
-        }
+    if(hid_code == 0 || hid_code > 0xff || isPressed(hid_code)){
+        return;
     }
+    batchCheck(keyReported(hid_code), 0);
+    pressed_keys[KEY_BYTE(hid_code)] |= KEY_BIT(hid_code);
+    num_pressed++;
+}
 
-    // No empty slot found
+/*
+    The boot report only has room for 13 usages, with more than that
+    held every slot reports ErrorRollOver rather than a partial list.
+*/
+static void bootKeys(unsigned char *keys){
+    int x, slot = 0;
+    memset(keys, 0, HID_BOOT_KEYS);
+    if(num_pressed > HID_BOOT_KEYS){
+        memset(keys, 0x01, HID_BOOT_KEYS);
+        return;
+    }
+    for(x = 0; x < 32 && slot < num_pressed; x++){
+        unsigned char bits = pressed_keys[x];
+        while(bits){
+            keys[slot++] = (x << 3) | __builtin_ctz(bits);
+            bits &= bits - 1;
+        }
+    }
 }
 
-void sendMIDINote(int channel, int note, int velocity, int state) {
-    unsigned char buf[3];
+void sendMIDINote(int port, int channel, int note, int velocity, int state) {
+    unsigned char status;
     if(state == 1){
-        buf[0] = 0x90;
+        status = 0x90;
     }
     else
     {
-        buf[0] = 0x80;
+        status = 0x80;
     }
-    buf[0] |= channel & 0xf;
-    buf[1] = note & 0x7f;
-    buf[2] = velocity & 0x7f;
-    write(midi_output, buf, 3);
+    status |= channel & 0xf;
+    midi_out_message(port, status, note, velocity);
 }
 
-void sendHIDReport(){
-    int x;
-    unsigned char buf[16];
-    buf[0] = 1; // report id
+static unsigned long last_dropped = 0;
+
+void flushHIDReport(){
+    unsigned char buf[HID_NKRO_REPORT_SIZE];
+    int length;
     buf[1] = modifiers;
-    buf[2] = 0; // padding
-    for(x = 3; x < 16; x++){
-        buf[x] = pressed_keys[x-3];
+    if(hid_report_mode == HID_MODE_NKRO){
+        buf[0] = 3; // report id
+        memcpy(buf + 2, pressed_keys, sizeof(pressed_keys));
+        length = HID_NKRO_REPORT_SIZE;
+    }
+    else {
+        buf[0] = 1; // report id
+        buf[2] = 0; // padding
+        bootKeys(buf + 3);
+        length = HID_REPORT_SIZE;
+    }
+    // A report the writer had to drop may be the one being repeated
+    unsigned long dropped = __atomic_load_n(&hid_stats.dropped, __ATOMIC_RELAXED);
+    if(dropped != last_dropped){
+        last_dropped = dropped;
+        invalidateHIDReport();
+    }
+    if(memcmp(buf, last_report, length) == 0){
+        __atomic_add_fetch(&hid_stats.suppressed, 1, __ATOMIC_RELAXED);
+        latency_take_edge();
+    }
+    else {
+        hid_writer_queue(buf, length, latency_take_edge());
+        memcpy(last_report, buf, length);
     }
-    write(hid_output, buf, HID_REPORT_SIZE);
-    usleep(1000);
+    memcpy(reported_keys, pressed_keys, sizeof(pressed_keys));
+    hid_batch_dirty = 0;
 
     if(media_keys != last_media_keys){
         buf[0] = 2; // report id
         buf[1] = media_keys; // media keys
-        write(hid_output, buf, 2);
-        usleep(1000);
+        hid_writer_queue(buf, 2, 0);
         last_media_keys = media_keys;
     }
 }
 
-int toggleMediaKey(unsigned short modifier) {
-    if(media_keys & (1 << modifier)){
-        media_keys &= ~(1 << modifier);
+/* Something else wrote to the keyboard report, so the next one goes out regardless */
+void invalidateHIDReport(){
+    last_report[0] = 0;
+}
+
+/* Switching reports releases everything on the old one first */
+void setReportMode(int mode){
+    unsigned char buf[HID_NKRO_REPORT_SIZE];
+    if(mode == hid_report_mode){
+        return;
     }
-    else
-    {
-        media_keys |= (1 << modifier);
+    if(mode == HID_MODE_NKRO && usb_settings.hid_report_length < HID_NKRO_REPORT_SIZE){
+        printf("Error: N-key rollover needs a report_length of at least %d\n", HID_NKRO_REPORT_SIZE);
+        return;
+    }
+    memset(buf, 0, sizeof(buf));
+    if(hid_report_mode == HID_MODE_NKRO){
+        buf[0] = 3; // report id
+        hid_writer_queue(buf, HID_NKRO_REPORT_SIZE, 0);
+    }
+    else {
+        buf[0] = 1; // report id
+        hid_writer_queue(buf, HID_REPORT_SIZE, 0);
     }
+    hid_report_mode = mode;
+    invalidateHIDReport();
+    flushHIDReport();
+}
+
+/* While a batch is open changes only mark the report dirty */
+void sendHIDReport(){
+    if(hid_batching){
+        hid_batch_dirty = 1;
+        return;
+    }
+    flushHIDReport();
+}
+
+void hidBeginBatch(){
+    hid_batching = hid_batch_mode;
+}
+
+void hidFlushBatch(){
+    if(hid_batch_dirty){
+        flushHIDReport();
+    }
+}
+
+void hidEndBatch(){
+    hidFlushBatch();
+    hid_batching = 0;
+}
+
+void setModifier(unsigned short index, unsigned short state){
+    batchCheck((last_report[1] >> index) & 1, (modifiers >> index) & 1);
+    modifiers &= ~(1 << index);
+    modifiers |= (state << index);
+}
+
+/* Change every modifier bit that differs from mask */
+void setModifiers(unsigned short mask){
+    int x;
+    for(x = 0; x < 8; x++){
+        unsigned short state = (mask >> x) & 1;
+        if(((modifiers >> x) & 1) != state){
+            setModifier(x, state);
+        }
+    }
+}
+
+void setMediaKey(unsigned short index, unsigned short state){
+    batchCheck((last_media_keys >> index) & 1, (media_keys >> index) & 1);
+    media_keys &= ~(1 << index);
+    media_keys |= (state << index);
+}
+
+int toggleMediaKey(unsigned short modifier) {
+    setMediaKey(modifier, !(media_keys & (1 << modifier)));
     sendHIDReport();
 
     return (media_keys & (1 << modifier)) > 0;
@@ -88,13 +223,7 @@ int toggleMediaKey(unsigned short modifier) {
 
 
 int toggleModifier(unsigned short modifier) {
-    if(modifiers & (1 << modifier)){
-        modifiers &= ~(1 << modifier);
-    }
-    else
-    {
-        modifiers |= (1 << modifier);
-    }
+    setModifier(modifier, !(modifiers & (1 << modifier)));
     sendHIDReport();
 
     return (modifiers & (1 << modifier)) > 0;
@@ -182,7 +311,10 @@ static int l_usleep(lua_State *L) {
     int nargs = lua_gettop(L);
     int t = luaL_checknumber(L, 1);
     lua_pop(L, nargs);
-    usleep(t);
+    hidFlushBatch();
+    midi_out_flush();
+    lights_publish();
+    delay_us(t);
     return 0;
 }
 
@@ -190,7 +322,417 @@ static int l_sleep(lua_State *L) {
     int nargs = lua_gettop(L);
     int t = luaL_checknumber(L, 1);
     lua_pop(L, nargs);
-    usleep(t * 1000);
+    hidFlushBatch();
+    midi_out_flush();
+    lights_publish();
+    delay_us(t * 1000);
+    return 0;
+}
+
+static int l_set_scan_mode(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short mode = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    scan_mode = mode == SCAN_MODE_EDGE ? SCAN_MODE_EDGE : SCAN_MODE_POLL;
+    return 0;
+}
+
+static int l_set_debounce(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short key_index = luaL_checknumber(L, 1);
+    unsigned short mode = luaL_checknumber(L, 2);
+    unsigned int press_ms = luaL_optnumber(L, 3, DEBOUNCE_DEFAULT_MS);
+    unsigned int release_ms = luaL_optnumber(L, 4, press_ms);
+    lua_pop(L, nargs);
+    debounce_set(key_index, mode, press_ms, release_ms);
+    return 0;
+}
+
+static int l_get_debounce_rejects(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short key_index = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    if(key_index >= NUM_KEYS){
+        return 0;
+    }
+    lua_pushnumber(L, debounce_keys[key_index].rejected);
+    return 1;
+}
+
+static int l_get_key_overflows(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    lua_pushnumber(L, __atomic_load_n(&key_events.overflows, __ATOMIC_RELAXED));
+    return 1;
+}
+
+static int l_latency_report(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    char report[2048];
+    int length = latency_format(report, sizeof(report));
+    lua_pushlstring(L, report, length);
+    return 1;
+}
+
+static int l_latency_reset(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    latency_reset();
+    return 0;
+}
+
+static int l_trace_start(lua_State *L) {
+    int nargs = lua_gettop(L);
+    const char *file_name = luaL_checkstring(L, 1);
+    // Don't clobber traces while replaying one
+    int result = clock_simulated ? 1 : trace_start(file_name);
+    lua_pop(L, nargs);
+    lua_pushboolean(L, result == 0);
+    return 1;
+}
+
+static int l_trace_stop(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    trace_stop();
+    return 0;
+}
+
+static int l_get_hid_stats(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    lua_pushnumber(L, __atomic_load_n(&hid_stats.sent, __ATOMIC_RELAXED));
+    lua_pushnumber(L, __atomic_load_n(&hid_stats.retried, __ATOMIC_RELAXED));
+    lua_pushnumber(L, __atomic_load_n(&hid_stats.dropped, __ATOMIC_RELAXED));
+    lua_pushnumber(L, __atomic_load_n(&hid_stats.suppressed, __ATOMIC_RELAXED));
+    return 4;
+}
+
+static int l_set_report_batching(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short state = lua_toboolean(L, 1);
+    lua_pop(L, nargs);
+    hid_batch_mode = state;
+    return 0;
+}
+
+static int compileText(int id, const char *text, size_t length){
+    unsigned char mods = 0;
+    int failed = 0;
+    size_t x;
+    for(x = 0; x < length; x++){
+        unsigned char code = text[x];
+        if(code >= 128 || ascii_hid_table[code].usage == 0){
+            continue;
+        }
+        ascii_hid key = ascii_hid_table[code];
+        if(key.modifiers != mods){
+            mods = key.modifiers;
+            failed |= macro_add_report(id, mods, 0);
+        }
+        failed |= macro_add_report(id, mods, key.usage);
+        failed |= macro_add_report(id, mods, 0);
+    }
+    if(mods){
+        failed |= macro_add_report(id, 0, 0);
+    }
+    return failed;
+}
+
+/* {key = "c", modifiers = {keybow.LEFT_CTRL}}, tapped with the modifiers held */
+static int compileChord(lua_State *L, int id, int index){
+    unsigned char mods = 0;
+    unsigned short hid_code = 0;
+    int failed = 0;
+
+    lua_getfield(L, index, "key");
+    if(lua_type(L, -1) == LUA_TSTRING){
+        unsigned char code = lua_tostring(L, -1)[0];
+        if(code < 128){
+            hid_code = ascii_hid_table[code].usage;
+            mods = ascii_hid_table[code].modifiers;
+        }
+    }
+    else if(lua_isnumber(L, -1)){
+        hid_code = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "modifiers");
+    if(lua_istable(L, -1)){
+        int x, count = lua_rawlen(L, -1);
+        for(x = 1; x <= count; x++){
+            lua_rawgeti(L, -1, x);
+            mods |= 1 << ((int)lua_tonumber(L, -1) & 7);
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    if(mods) failed |= macro_add_report(id, mods, 0);
+    if(hid_code){
+        failed |= macro_add_report(id, mods, hid_code & 0xff);
+        failed |= macro_add_report(id, mods, 0);
+    }
+    if(mods) failed |= macro_add_report(id, 0, 0);
+    return failed;
+}
+
+/*
+    Steps are strings to type, numbers to pause for (in milliseconds)
+    and chords, all turned into reports once here rather than per play.
+*/
+static int l_compile_macro(lua_State *L) {
+    int nargs = lua_gettop(L);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int id = macro_new();
+    if(id == -1){
+        lua_pop(L, nargs);
+        return 0;
+    }
+
+    int failed = 0;
+    int x, count = lua_rawlen(L, 1);
+    for(x = 1; x <= count && !failed; x++){
+        size_t length;
+        const char *text;
+        lua_rawgeti(L, 1, x);
+        switch(lua_type(L, -1)){
+            case LUA_TSTRING:
+                text = lua_tolstring(L, -1, &length);
+                failed = compileText(id, text, length);
+                break;
+            case LUA_TNUMBER:
+                failed = macro_add_delay(id, lua_tonumber(L, -1) * 1000);
+                break;
+            case LUA_TTABLE:
+                failed = compileChord(L, id, lua_gettop(L));
+                break;
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, nargs);
+    // A macro missing a report could leave a key held down on the host
+    if(failed){
+        printf("Error compiling macro, out of memory.\n");
+        macro_free(id);
+        return 0;
+    }
+    lua_pushnumber(L, id);
+    return 1;
+}
+
+static int l_play_macro(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int id = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    int ret = macro_play(id);
+    // Replays play the macro synchronously, so it is already over
+    if(macro_take_finished()){
+        invalidateHIDReport();
+        flushHIDReport();
+    }
+    lua_pushboolean(L, ret);
+    return 1;
+}
+
+static int l_cancel_macro(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    macro_cancel();
+    return 0;
+}
+
+static int l_macro_progress(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    unsigned int step, count;
+    lua_pushboolean(L, macro_progress(&step, &count));
+    lua_pushnumber(L, step);
+    lua_pushnumber(L, count);
+    return 3;
+}
+
+static int l_free_macro(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int id = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    lua_pushboolean(L, macro_free(id));
+    return 1;
+}
+
+static int l_mouse_button(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short button = luaL_checknumber(L, 1);
+    unsigned short state = lua_toboolean(L, 2);
+    lua_pop(L, nargs);
+    mouse_set_button(button, state);
+    return 0;
+}
+
+static int l_mouse_move_key(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int dx = luaL_checknumber(L, 1);
+    int dy = luaL_checknumber(L, 2);
+    unsigned short state = lua_toboolean(L, 3);
+    lua_pop(L, nargs);
+    mouse_push_direction(dx, dy, state);
+    return 0;
+}
+
+static int l_mouse_wheel_key(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int dv = luaL_checknumber(L, 1);
+    int dh = luaL_checknumber(L, 2);
+    unsigned short state = lua_toboolean(L, 3);
+    lua_pop(L, nargs);
+    mouse_push_wheel(dv, dh, state);
+    return 0;
+}
+
+static int l_mouse_scroll(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int v = luaL_checknumber(L, 1);
+    int h = luaL_optnumber(L, 2, 0);
+    lua_pop(L, nargs);
+    mouse_scroll(v, h);
+    return 0;
+}
+
+static int l_mouse_set_acceleration(lua_State *L) {
+    int nargs = lua_gettop(L);
+    float speed = luaL_checknumber(L, 1);
+    float max_speed = luaL_optnumber(L, 2, speed);
+    unsigned int accel_ms = luaL_optnumber(L, 3, MOUSE_DEFAULT_ACCEL_MS);
+    float wheel_speed = luaL_optnumber(L, 4, MOUSE_DEFAULT_WHEEL);
+    lua_pop(L, nargs);
+    mouse_set_acceleration(speed, max_speed, accel_ms, wheel_speed);
+    return 0;
+}
+
+static int l_midi_note_light(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short note = luaL_checknumber(L, 1);
+    if(lua_isnoneornil(L, 2)){
+        lua_pop(L, nargs);
+        midi_in_map_note(note, -1, 0, 0, 0);
+        return 0;
+    }
+    unsigned short x = luaL_checknumber(L, 2);
+    if(x >= NUM_KEYS){
+        return luaL_argerror(L, 2, "no such key");
+    }
+    unsigned short r = luaL_checknumber(L, 3);
+    unsigned short g = luaL_checknumber(L, 4);
+    unsigned short b = luaL_checknumber(L, 5);
+    lua_pop(L, nargs);
+
+    keybow_key key = get_key(x);
+    midi_in_map_note(note, key.led_index, r, g, b);
+    return 0;
+}
+
+static int l_get_midi_clock(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    midi_clock_state clock;
+    midi_clock_get(micros(), &clock);
+    lua_pushboolean(L, clock.running);
+    lua_pushboolean(L, clock.locked);
+    lua_pushnumber(L, clock.bpm);
+    lua_pushnumber(L, clock.beat);
+    return 4;
+}
+
+static int l_lights_sync_clock(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int frames = luaL_optnumber(L, 1, 0);
+    lua_pop(L, nargs);
+    lights_frames_per_beat = frames < 0 ? 0 : frames;
+    return 0;
+}
+
+static int l_set_pattern_cache(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int bytes = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    pthread_mutex_lock(&lights_mutex);
+    pattern_cache_set_budget(bytes < 0 ? 0 : bytes);
+    pthread_mutex_unlock(&lights_mutex);
+    return 0;
+}
+
+static int l_get_pattern_cache_stats(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    pthread_mutex_lock(&lights_mutex);
+    pattern_cache_stats stats = pattern_cache_total;
+    pthread_mutex_unlock(&lights_mutex);
+    lua_pushnumber(L, stats.hits);
+    lua_pushnumber(L, stats.misses);
+    lua_pushnumber(L, stats.evictions);
+    lua_pushnumber(L, stats.bytes);
+    lua_pushnumber(L, stats.entries);
+    return 5;
+}
+
+static int l_lights_refresh(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int ms = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    lights_setRefresh(ms < 0 ? 0 : ms);
+    return 0;
+}
+
+static int l_get_midi_stats(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    lua_pushnumber(L, midi_in_stats.received);
+    lua_pushnumber(L, midi_in_stats.overflows);
+    lua_pushnumber(L, midi_in_stats.truncated);
+    return 3;
+}
+
+static int l_get_host_leds(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    unsigned char leds = host_leds_get();
+    int x;
+    for(x = 0; x < NUM_HOST_LEDS; x++){
+        lua_pushboolean(L, (leds >> x) & 1);
+    }
+    return NUM_HOST_LEDS;
+}
+
+static int l_mirror_host_led(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short led = luaL_checknumber(L, 1);
+    if(lua_isnoneornil(L, 2)){
+        lua_pop(L, nargs);
+        lights_mirrorHostLed(led, 0, 0, 0, 0, 0);
+        return 0;
+    }
+    unsigned short x = luaL_checknumber(L, 2);
+    if(x >= NUM_KEYS){
+        return luaL_argerror(L, 2, "no such key");
+    }
+    unsigned short r = luaL_checknumber(L, 3);
+    unsigned short g = luaL_checknumber(L, 4);
+    unsigned short b = luaL_checknumber(L, 5);
+    lua_pop(L, nargs);
+
+    keybow_key key = get_key(x);
+    lights_mirrorHostLed(led, 1, key.led_index, r, g, b);
+    return 0;
+}
+
+static int l_set_nkro(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short state = lua_toboolean(L, 1);
+    lua_pop(L, nargs);
+    setReportMode(state ? HID_MODE_NKRO : HID_MODE_BOOT);
     return 0;
 }
 
@@ -200,11 +742,234 @@ static int l_send_midi_note(lua_State *L) {
     unsigned short note = luaL_checknumber(L, 2);
     unsigned short velocity = luaL_checknumber(L, 3);
     unsigned short state = lua_toboolean(L, 4);
+    int port = luaL_optnumber(L, 5, 0);
+    lua_pop(L, nargs);
+    sendMIDINote(port, channel, note, velocity, state);
+    return 0;
+}
+
+static int l_send_midi_cc(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short channel = luaL_checknumber(L, 1);
+    unsigned short controller = luaL_checknumber(L, 2);
+    unsigned short value = luaL_checknumber(L, 3);
+    int port = luaL_optnumber(L, 4, 0);
+    lua_pop(L, nargs);
+    midi_out_message(port, MIDI_CONTROL_CHANGE | (channel & 0xf), controller, value);
+    return 0;
+}
+
+static int l_send_midi_program(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short channel = luaL_checknumber(L, 1);
+    unsigned short program = luaL_checknumber(L, 2);
+    int port = luaL_optnumber(L, 3, 0);
+    lua_pop(L, nargs);
+    midi_out_message(port, MIDI_PROGRAM_CHANGE | (channel & 0xf), program, 0);
+    return 0;
+}
+
+/* -8192 to 8191, 0 is centred */
+static int l_send_midi_pitch_bend(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short channel = luaL_checknumber(L, 1);
+    int bend = luaL_checknumber(L, 2) + 8192;
+    int port = luaL_optnumber(L, 3, 0);
+    lua_pop(L, nargs);
+    if(bend < 0) bend = 0;
+    if(bend > 16383) bend = 16383;
+    midi_out_message(port, MIDI_PITCH_BEND | (channel & 0xf), bend & 0x7f, bend >> 7);
+    return 0;
+}
+
+/* Channel pressure, or polyphonic aftertouch if a note is given */
+static int l_send_midi_aftertouch(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned short channel = luaL_checknumber(L, 1);
+    unsigned short pressure = luaL_checknumber(L, 2);
+    int note = luaL_optnumber(L, 3, -1);
+    int port = luaL_optnumber(L, 4, 0);
+    lua_pop(L, nargs);
+    if(note < 0){
+        midi_out_message(port, MIDI_CHANNEL_PRESSURE | (channel & 0xf), pressure, 0);
+    }
+    else {
+        midi_out_message(port, MIDI_POLY_AFTERTOUCH | (channel & 0xf), note, pressure);
+    }
+    return 0;
+}
+
+/* A string or table of data bytes, F0 and F7 are added if missing */
+static int l_send_midi_sysex(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned char data[MIDI_OUT_BUFFER + 2];
+    int length = 0;
+    size_t x, count;
+
+    data[length++] = MIDI_SYSEX;
+    if(lua_type(L, 1) == LUA_TSTRING){
+        const char *bytes = lua_tolstring(L, 1, &count);
+        for(x = 0; x < count && length < MIDI_OUT_BUFFER; x++){
+            unsigned char byte = bytes[x];
+            if(byte == MIDI_SYSEX || byte == MIDI_SYSEX_END) continue;
+            data[length++] = byte & 0x7f;
+        }
+    }
+    else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        count = lua_rawlen(L, 1);
+        for(x = 1; x <= count && length < MIDI_OUT_BUFFER; x++){
+            lua_rawgeti(L, 1, x);
+            unsigned char byte = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+            if(byte == MIDI_SYSEX || byte == MIDI_SYSEX_END) continue;
+            data[length++] = byte & 0x7f;
+        }
+    }
+    data[length++] = MIDI_SYSEX_END;
+    int port = luaL_optnumber(L, 2, 0);
+    lua_pop(L, nargs);
+    midi_out_sysex(port, data, length);
+    return 0;
+}
+
+static int l_midi_flush(lua_State *L) {
+    int nargs = lua_gettop(L);
     lua_pop(L, nargs);
-    sendMIDINote(channel, note, velocity, state);
+    midi_out_flush();
     return 0;
 }
 
+/* All ports together unless one is given */
+static int l_get_midi_out_stats(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int port = luaL_optnumber(L, 1, -1);
+    lua_pop(L, nargs);
+    midi_out_stats stats;
+    midi_out_get_stats(port, &stats);
+    lua_pushnumber(L, stats.messages);
+    lua_pushnumber(L, stats.writes);
+    lua_pushnumber(L, stats.status_saved);
+    lua_pushnumber(L, stats.dropped);
+    lua_pushnumber(L, stats.queue_full);
+    return 5;
+}
+
+static unsigned char getByteField(lua_State *L, int index, const char *name, int fallback){
+    lua_getfield(L, index, name);
+    int value = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : fallback;
+    lua_pop(L, 1);
+    return value < 0 ? 0 : (value > 127 ? 127 : value);
+}
+
+/*
+    Steps are note numbers, false for a rest, or {note =, velocity =, gate =}
+    with the gate as a percentage of the step.
+*/
+static int l_seq_set_pattern(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int id = luaL_checknumber(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    unsigned char channel = luaL_optnumber(L, 3, 0);
+    unsigned char division = luaL_optnumber(L, 4, SEQ_DEFAULT_DIVISION);
+    unsigned char swing = luaL_optnumber(L, 5, 50);
+    int gate = luaL_optnumber(L, 6, 50);
+    int port = luaL_optnumber(L, 7, 0);
+    seq_step steps[SEQ_MAX_STEPS];
+
+    int x, count = lua_rawlen(L, 2);
+    if(count > SEQ_MAX_STEPS) count = SEQ_MAX_STEPS;
+    memset(steps, 0, sizeof(steps));
+    for(x = 0; x < count; x++){
+        lua_rawgeti(L, 2, x + 1);
+        switch(lua_type(L, -1)){
+            case LUA_TNUMBER:
+                steps[x].note = (int)lua_tonumber(L, -1) & 0x7f;
+                steps[x].velocity = 100;
+                steps[x].gate = gate;
+                break;
+            case LUA_TTABLE:
+                steps[x].note = getByteField(L, lua_gettop(L), "note", 60);
+                steps[x].velocity = getByteField(L, lua_gettop(L), "velocity", 100);
+                steps[x].gate = getByteField(L, lua_gettop(L), "gate", gate);
+                break;
+        }
+        if(steps[x].gate < 1) steps[x].gate = 1;
+        if(steps[x].gate > 100) steps[x].gate = 100;
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, nargs);
+    lua_pushboolean(L, seq_set_pattern(id, steps, count, port, channel, division, swing) == 0);
+    return 1;
+}
+
+static int l_seq_play(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int id = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    lua_pushboolean(L, seq_play(id) == 0);
+    return 1;
+}
+
+static int l_seq_stop(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int id = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    seq_stop_pattern(id);
+    return 0;
+}
+
+static int l_seq_position(lua_State *L) {
+    int nargs = lua_gettop(L);
+    int id = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    lua_pushnumber(L, seq_position(id));
+    return 1;
+}
+
+static int l_seq_tempo(lua_State *L) {
+    int nargs = lua_gettop(L);
+    double bpm = luaL_checknumber(L, 1);
+    lua_pop(L, nargs);
+    seq_set_tempo(bpm);
+    return 0;
+}
+
+static int l_arp_configure(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned char mode = luaL_optnumber(L, 1, ARP_UP);
+    unsigned char channel = luaL_optnumber(L, 2, 0);
+    unsigned char division = luaL_optnumber(L, 3, SEQ_DEFAULT_DIVISION);
+    unsigned char octaves = luaL_optnumber(L, 4, 1);
+    unsigned char gate = luaL_optnumber(L, 5, 50);
+    int port = luaL_optnumber(L, 6, 0);
+    lua_pop(L, nargs);
+    arp_configure(mode, port, channel, division, octaves, gate);
+    return 0;
+}
+
+static int l_arp_note(lua_State *L) {
+    int nargs = lua_gettop(L);
+    unsigned char note = (int)luaL_checknumber(L, 1) & 0x7f;
+    unsigned char velocity = (int)luaL_optnumber(L, 2, 0) & 0x7f;
+    lua_pop(L, nargs);
+    arp_note(note, velocity);
+    return 0;
+}
+
+static int l_get_seq_stats(lua_State *L) {
+    int nargs = lua_gettop(L);
+    lua_pop(L, nargs);
+    seq_stats stats;
+    seq_get_stats(&stats);
+    lua_pushnumber(L, stats.events);
+    lua_pushnumber(L, stats.events ? stats.total_us / stats.events : 0);
+    lua_pushnumber(L, stats.max_us);
+    lua_pushnumber(L, stats.late);
+    return 4;
+}
+
 static int l_get_modifier(lua_State *L) {
     int nargs = lua_gettop(L);
     unsigned short index = luaL_checknumber(L, 1);
@@ -227,8 +992,7 @@ static int l_set_modifier(lua_State *L) {
 #endif
 
     if(current != state){
-        modifiers &= ~(1 << index);
-        modifiers |= (state << index);
+        setModifier(index, state);
 #ifdef KEYBOW_DEBUG
         printf("Modifier %d set to %d\n", index, state);
 #endif
@@ -252,8 +1016,7 @@ static int l_set_media_key(lua_State *L) {
 #endif
 
     if(current != state){
-        media_keys &= ~(1 << index);
-        media_keys |= (state << index);
+        setMediaKey(index, state);
 #ifdef KEYBOW_DEBUG
         printf("Media Key %d set to %d\n", index, state);
 #endif
@@ -269,35 +1032,43 @@ static int l_send_text(lua_State *L) {
     size_t length;
     const char *message = luaL_checklstring(L, 1, &length);
     lua_pop(L, nargs);
+    unsigned short held = modifiers;
     int x = 0;
     for(x = 0; x < length; x++){
-        int hid_code = 0;
-        int shift = 0;
-        int code = message[x];
-        if (code == 48){hid_code = 39;}
-        if (code == 32){hid_code = 44;}
-        if (code >= 49 && code <= 57){
-            hid_code = code - 19;
-        }
-        if (code >= 65 && code <= 90){
-            hid_code = code - 61;
-            shift = 1;
+        unsigned char code = message[x];
+        if(code >= 128 || ascii_hid_table[code].usage == 0){
+            continue;
         }
-        if (code >= 97 && code <= 122){
-            hid_code = code - 93;
-        }
-        if (hid_code != 0){
-            if(shift) toggleModifier(1);
-            pressKey(hid_code);
-            sendHIDReport();       
-            releaseKey(hid_code);
+        ascii_hid key = ascii_hid_table[code];
+        if((held | key.modifiers) != modifiers){
+            setModifiers(held | key.modifiers);
             sendHIDReport();
-            if(shift) toggleModifier(1);
         }
+        pressKey(key.usage);
+        sendHIDReport();
+        releaseKey(key.usage);
+        sendHIDReport();
+    }
+    if(modifiers != held){
+        setModifiers(held);
+        sendHIDReport();
     }
     return 0;
 }
 
+static int l_ascii_to_hid(lua_State *L) {
+    int nargs = lua_gettop(L);
+    const char *key = luaL_checkstring(L, 1);
+    unsigned char code = key[0];
+    lua_pop(L, nargs);
+    if(code >= 128 || ascii_hid_table[code].usage == 0){
+        return 0;
+    }
+    lua_pushnumber(L, ascii_hid_table[code].usage);
+    lua_pushboolean(L, ascii_hid_table[code].modifiers & HID_MOD_LEFT_SHIFT);
+    return 2;
+}
+
 static int l_auto_lights(lua_State *L) {
     int nargs = lua_gettop(L);
     unsigned short state = lua_toboolean(L, 1);
@@ -330,10 +1101,31 @@ static int l_set_pixel(lua_State *L) {
 
 static int l_set_key(lua_State *L) {
     int nargs = lua_gettop(L);
-    unsigned short hid_code = luaL_checknumber(L, 1);
+    unsigned short hid_code;
+    unsigned short shift = 0;
     unsigned short state = lua_toboolean(L, 2);
+
+    if(lua_type(L, 1) == LUA_TSTRING){
+        unsigned char code = lua_tostring(L, 1)[0];
+        if(code >= 128 || ascii_hid_table[code].usage == 0){
+            lua_pop(L, nargs);
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+        hid_code = ascii_hid_table[code].usage;
+        shift = ascii_hid_table[code].modifiers & HID_MOD_LEFT_SHIFT;
+    }
+    else {
+        hid_code = luaL_checknumber(L, 1);
+    }
     lua_pop(L, nargs);
 
+    // Shift follows the key, as keybow.set_key() always did
+    if(shift && ((modifiers >> 1) & 1) != state){
+        setModifier(1, state);
+        sendHIDReport();
+    }
+
     printf("l_set_key %02x %d\n", hid_code, state);
     if(state){
         if(!isPressed(hid_code)){
@@ -364,11 +1156,14 @@ static int l_load_pattern(lua_State *L) {
     char filename[length + 10];
     sprintf(filename, "%s.png", pattern);
 
-    pthread_mutex_lock(&lights_mutex);
-    int result = read_png_file(filename);
-    pthread_mutex_unlock(&lights_mutex);
-    
-    lua_pushboolean(L, result == 0);
+    // Decoded in the background, keybow_pattern_loaded() gets called when it's on show
+    int id = pattern_load(filename);
+    if(id == -1){
+        lua_pushnil(L);
+    }
+    else {
+        lua_pushnumber(L, id);
+    }
 
     return 1;
 }
@@ -382,6 +1177,8 @@ static int l_get_millis(lua_State *L) {
 
 int initLUA() {
     modifiers = 0;
+    hid_batch_mode = 1;
+    hid_report_mode = HID_MODE_BOOT;
 
     L = luaL_newstate();
     luaL_openlibs(L);
@@ -404,12 +1201,129 @@ int initLUA() {
     lua_pushcfunction(L, l_send_text);
     lua_setglobal(L, "keybow_text");
 
+    lua_pushcfunction(L, l_ascii_to_hid);
+    lua_setglobal(L, "keybow_ascii_to_hid");
+
     lua_pushcfunction(L, l_sleep);
     lua_setglobal(L, "keybow_sleep");
 
     lua_pushcfunction(L, l_usleep);
     lua_setglobal(L, "keybow_usleep");
 
+    lua_pushcfunction(L, l_set_scan_mode);
+    lua_setglobal(L, "keybow_set_scan_mode");
+
+    lua_pushcfunction(L, l_set_debounce);
+    lua_setglobal(L, "keybow_set_debounce");
+
+    lua_pushcfunction(L, l_get_debounce_rejects);
+    lua_setglobal(L, "keybow_get_debounce_rejects");
+
+    lua_pushcfunction(L, l_get_key_overflows);
+    lua_setglobal(L, "keybow_get_key_overflows");
+
+    lua_pushcfunction(L, l_latency_report);
+    lua_setglobal(L, "keybow_latency_report");
+
+    lua_pushcfunction(L, l_latency_reset);
+    lua_setglobal(L, "keybow_latency_reset");
+
+    lua_pushcfunction(L, l_trace_start);
+    lua_setglobal(L, "keybow_trace_start");
+
+    lua_pushcfunction(L, l_trace_stop);
+    lua_setglobal(L, "keybow_trace_stop");
+
+    lua_pushcfunction(L, l_get_hid_stats);
+    lua_setglobal(L, "keybow_get_hid_stats");
+
+    lua_pushcfunction(L, l_set_report_batching);
+    lua_setglobal(L, "keybow_set_report_batching");
+
+    lua_pushcfunction(L, l_set_nkro);
+    lua_setglobal(L, "keybow_set_nkro");
+
+    lua_pushcfunction(L, l_compile_macro);
+    lua_setglobal(L, "keybow_compile_macro");
+
+    lua_pushcfunction(L, l_play_macro);
+    lua_setglobal(L, "keybow_play_macro");
+
+    lua_pushcfunction(L, l_cancel_macro);
+    lua_setglobal(L, "keybow_cancel_macro");
+
+    lua_pushcfunction(L, l_macro_progress);
+    lua_setglobal(L, "keybow_macro_progress");
+
+    lua_pushcfunction(L, l_free_macro);
+    lua_setglobal(L, "keybow_free_macro");
+
+    lua_pushcfunction(L, l_mouse_button);
+    lua_setglobal(L, "keybow_mouse_button");
+
+    lua_pushcfunction(L, l_mouse_move_key);
+    lua_setglobal(L, "keybow_mouse_move_key");
+
+    lua_pushcfunction(L, l_mouse_wheel_key);
+    lua_setglobal(L, "keybow_mouse_wheel_key");
+
+    lua_pushcfunction(L, l_mouse_scroll);
+    lua_setglobal(L, "keybow_mouse_scroll");
+
+    lua_pushcfunction(L, l_mouse_set_acceleration);
+    lua_setglobal(L, "keybow_mouse_set_acceleration");
+
+    lua_pushcfunction(L, l_midi_note_light);
+    lua_setglobal(L, "keybow_midi_note_light");
+
+    lua_pushcfunction(L, l_seq_set_pattern);
+    lua_setglobal(L, "keybow_seq_set_pattern");
+
+    lua_pushcfunction(L, l_seq_play);
+    lua_setglobal(L, "keybow_seq_play");
+
+    lua_pushcfunction(L, l_seq_stop);
+    lua_setglobal(L, "keybow_seq_stop");
+
+    lua_pushcfunction(L, l_seq_position);
+    lua_setglobal(L, "keybow_seq_position");
+
+    lua_pushcfunction(L, l_seq_tempo);
+    lua_setglobal(L, "keybow_seq_tempo");
+
+    lua_pushcfunction(L, l_arp_configure);
+    lua_setglobal(L, "keybow_arp_configure");
+
+    lua_pushcfunction(L, l_arp_note);
+    lua_setglobal(L, "keybow_arp_note");
+
+    lua_pushcfunction(L, l_get_seq_stats);
+    lua_setglobal(L, "keybow_get_seq_stats");
+
+    lua_pushcfunction(L, l_get_midi_clock);
+    lua_setglobal(L, "keybow_get_midi_clock");
+
+    lua_pushcfunction(L, l_lights_sync_clock);
+    lua_setglobal(L, "keybow_lights_sync_clock");
+
+    lua_pushcfunction(L, l_set_pattern_cache);
+    lua_setglobal(L, "keybow_set_pattern_cache");
+
+    lua_pushcfunction(L, l_get_pattern_cache_stats);
+    lua_setglobal(L, "keybow_get_pattern_cache_stats");
+
+    lua_pushcfunction(L, l_lights_refresh);
+    lua_setglobal(L, "keybow_lights_refresh");
+
+    lua_pushcfunction(L, l_get_midi_stats);
+    lua_setglobal(L, "keybow_get_midi_stats");
+
+    lua_pushcfunction(L, l_get_host_leds);
+    lua_setglobal(L, "keybow_get_host_leds");
+
+    lua_pushcfunction(L, l_mirror_host_led);
+    lua_setglobal(L, "keybow_mirror_host_led");
+
     lua_pushcfunction(L, l_set_modifier);
     lua_setglobal(L, "keybow_set_modifier");
 
@@ -419,6 +1333,27 @@ int initLUA() {
     lua_pushcfunction(L, l_send_midi_note);
     lua_setglobal(L, "keybow_send_midi_note");
 
+    lua_pushcfunction(L, l_send_midi_cc);
+    lua_setglobal(L, "keybow_send_midi_cc");
+
+    lua_pushcfunction(L, l_send_midi_program);
+    lua_setglobal(L, "keybow_send_midi_program");
+
+    lua_pushcfunction(L, l_send_midi_pitch_bend);
+    lua_setglobal(L, "keybow_send_midi_pitch_bend");
+
+    lua_pushcfunction(L, l_send_midi_aftertouch);
+    lua_setglobal(L, "keybow_send_midi_aftertouch");
+
+    lua_pushcfunction(L, l_send_midi_sysex);
+    lua_setglobal(L, "keybow_send_midi_sysex");
+
+    lua_pushcfunction(L, l_midi_flush);
+    lua_setglobal(L, "keybow_midi_flush");
+
+    lua_pushcfunction(L, l_get_midi_out_stats);
+    lua_setglobal(L, "keybow_get_midi_out_stats");
+
     lua_pushcfunction(L, l_get_millis);
     lua_setglobal(L, "keybow_get_millis");
 
@@ -481,6 +1416,103 @@ int luaHandleKey(unsigned short key_index, unsigned short key_state) {
     return 0;
 }
 
+/* handle_host_leds is optional, most layouts don't care about lock keys */
+void luaHandleHostLeds(unsigned char leds){
+    int x;
+    lua_getglobal(L, "handle_host_leds");
+    if(!lua_isfunction(L, lua_gettop(L))){
+        lua_pop(L, 1);
+        return;
+    }
+    for(x = 0; x < NUM_HOST_LEDS; x++){
+        lua_pushboolean(L, (leds >> x) & 1);
+    }
+    if (lua_pcall(L, NUM_HOST_LEDS, 0, 0) != 0){
+        printf("Error running function `handle_host_leds`: %s", lua_tostring(L, -1));
+    }
+}
+
+/* Pushes the handler onto the stack, if keys.lua defines it */
+static int getHandler(const char *name){
+    lua_getglobal(L, name);
+    if(!lua_isfunction(L, lua_gettop(L))){
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+static void callHandler(const char *name, int nargs){
+    if (lua_pcall(L, nargs, 0, 0) != 0){
+        printf("Error running function `%s`: %s", name, lua_tostring(L, -1));
+    }
+}
+
+/*
+    Notes, CCs and SysEx get their own handlers, anything else
+    goes to handle_midi_message(status, channel, data1, data2)
+*/
+void luaHandleMidi(void){
+    midi_event event;
+    unsigned char *sysex;
+    while(midi_in_pop(&event, &sysex)){
+        switch(event.status){
+            case MIDI_NOTE_ON:
+            case MIDI_NOTE_OFF:
+                if(getHandler("handle_midi_note")){
+                    lua_pushnumber(L, event.channel);
+                    lua_pushnumber(L, event.data1);
+                    lua_pushnumber(L, event.data2);
+                    lua_pushboolean(L, event.status == MIDI_NOTE_ON);
+                    callHandler("handle_midi_note", 4);
+                }
+                break;
+            case MIDI_CONTROL_CHANGE:
+                if(getHandler("handle_midi_cc")){
+                    lua_pushnumber(L, event.channel);
+                    lua_pushnumber(L, event.data1);
+                    lua_pushnumber(L, event.data2);
+                    callHandler("handle_midi_cc", 3);
+                }
+                break;
+            case MIDI_SYSEX:
+                if(getHandler("handle_midi_sysex")){
+                    lua_pushlstring(L, (const char *)sysex, event.length);
+                    callHandler("handle_midi_sysex", 1);
+                }
+                midi_in_release_sysex();
+                break;
+            default:
+                if(getHandler("handle_midi_message")){
+                    lua_pushnumber(L, event.status);
+                    lua_pushnumber(L, event.channel);
+                    lua_pushnumber(L, event.data1);
+                    lua_pushnumber(L, event.data2);
+                    callHandler("handle_midi_message", 4);
+                }
+                break;
+        }
+    }
+}
+
+void luaHandlePatternLoads(void){
+    int id, ok;
+    while(pattern_load_take(&id, &ok)){
+        if(getHandler("keybow_pattern_loaded")){
+            lua_pushnumber(L, id);
+            lua_pushboolean(L, ok);
+            callHandler("keybow_pattern_loaded", 2);
+        }
+    }
+}
+
+void luaHandleBeat(unsigned long beat){
+    if(getHandler("handle_midi_beat")){
+        lua_pushnumber(L, beat);
+        callHandler("handle_midi_beat", 1);
+    }
+}
+
 void luaTick(void){
     if (has_tick == 0){return;}
     lua_getglobal(L, "tick");
@@ -489,12 +1521,16 @@ void luaTick(void){
 }
 
 void luaClose(void){
-    int x;
+    macro_stop();
+    mouse_stop();
+    seq_stop();
+    pattern_loader_stop();
+    midi_out_flush();
     modifiers = 0;
-    for(x = 0; x < 14; x++){
-        pressed_keys[x] = 0;        
-    }
+    memset(pressed_keys, 0, sizeof(pressed_keys));
+    num_pressed = 0;
     lua_close(L);
     sendHIDReport();
+    hid_writer_stop();
     close(hid_output);
 }
@@ -17,10 +17,33 @@ lua_State* L;
 unsigned short last_media_keys;
 unsigned short media_keys;
 unsigned short modifiers;
-unsigned short pressed_keys[14];
+unsigned char pressed_keys[32];     // One bit per keyboard usage
+unsigned char reported_keys[32];    // pressed_keys as of the last report
+unsigned short num_pressed;
+unsigned char last_report[34];     // Large enough for HID_NKRO_REPORT_SIZE
 
+#define HID_MODE_BOOT 0 // 13 key array report, works with BIOSes and KVMs
+#define HID_MODE_NKRO 1 // Usage bitmap report, any number of keys
+
+int hid_report_mode;
+
+int hid_batch_mode;     // Coalesce reports per scan/handler batch
+int hid_batching;       // A batch is open
+int hid_batch_dirty;    // State changed since the last report
+
+void setReportMode(int mode);
+void sendHIDReport();
+void flushHIDReport();
+void invalidateHIDReport();
+void hidBeginBatch();
+void hidFlushBatch();
+void hidEndBatch();
 int initLUA();
 void luaTick(void);
+void luaHandleHostLeds(unsigned char leds);
+void luaHandleMidi(void);
+void luaHandleBeat(unsigned long beat);
+void luaHandlePatternLoads(void);
 int luaHandleKey(unsigned short key_index, unsigned short state);
 void luaClose(void);
 void luaCallSetup(void);
@@ -0,0 +1,231 @@
+#include "macro.h"
+#include "hid-writer.h"
+#include "key-ring.h"
+#include "lights.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static pthread_t t_macro_player;
+static pthread_mutex_t player_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t player_cond;
+static int player_started = 0;
+static int player_running = 0;
+static int playing = -1;            // Macro being played, -1 when idle
+static int cancelled = 0;
+static int finished = 0;
+static unsigned int position = 0;
+
+/* Returns a free slot, or -1 */
+int macro_new(){
+    int x;
+    for(x = 0; x < MACRO_MAX; x++){
+        if(macros[x].allocated == 0){
+            macros[x].allocated = 16;
+            macros[x].count = 0;
+            macros[x].steps = malloc(sizeof(macro_step) * macros[x].allocated);
+            if(macros[x].steps == NULL){
+                macros[x].allocated = 0;
+                return -1;
+            }
+            return x;
+        }
+    }
+    return -1;
+}
+
+/* Returns 1 if out of memory, the macro is then missing the report */
+int macro_add_report(int id, unsigned char modifiers, unsigned char hid_code){
+    macro *m = &macros[id];
+    if(m->count == m->allocated){
+        macro_step *steps = realloc(m->steps, sizeof(macro_step) * m->allocated * 2);
+        if(steps == NULL) return 1;
+        m->steps = steps;
+        m->allocated *= 2;
+    }
+    macro_step *step = &m->steps[m->count++];
+    memset(step, 0, sizeof(macro_step));
+    step->report[0] = 1; // report id
+    step->report[1] = modifiers;
+    step->report[3] = hid_code;
+    return 0;
+}
+
+/* A delay before anything is pressed needs an empty report to hang off */
+int macro_add_delay(int id, unsigned int delay_us){
+    macro *m = &macros[id];
+    if(m->count == 0 && macro_add_report(id, 0, 0)){
+        return 1;
+    }
+    m->steps[m->count - 1].delay_us += delay_us;
+    return 0;
+}
+
+/* Returns 0, leaving it alone, for the macro being played */
+int macro_free(int id){
+    if(id < 0 || id >= MACRO_MAX) return 0;
+    pthread_mutex_lock(&player_mutex);
+    int ret = id != playing;
+    if(ret){
+        free(macros[id].steps);
+        macros[id].steps = NULL;
+        macros[id].count = 0;
+        macros[id].allocated = 0;
+    }
+    pthread_mutex_unlock(&player_mutex);
+    return ret;
+}
+
+/* Sleeps for us, returns early with 1 if the macro is cancelled */
+static int wait_cancelled(unsigned int us){
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += us / 1000000;
+    until.tv_nsec += (us % 1000000) * 1000;
+    if(until.tv_nsec >= 1000000000){
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&player_mutex);
+    while(!cancelled){
+        if(pthread_cond_timedwait(&player_cond, &player_mutex, &until) == ETIMEDOUT) break;
+    }
+    int ret = cancelled;
+    pthread_mutex_unlock(&player_mutex);
+    return ret;
+}
+
+static void *run_macro_player(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    unsigned char released[MACRO_REPORT_SIZE];
+    memset(released, 0, sizeof(released));
+    released[0] = 1; // report id
+
+    pthread_mutex_lock(&player_mutex);
+    while(player_running){
+        if(playing == -1){
+            pthread_cond_wait(&player_cond, &player_mutex);
+            continue;
+        }
+        macro *m = &macros[playing];
+        pthread_mutex_unlock(&player_mutex);
+
+        unsigned int x;
+        for(x = 0; x < m->count && !__atomic_load_n(&cancelled, __ATOMIC_RELAXED); x++){
+            hid_writer_queue(m->steps[x].report, MACRO_REPORT_SIZE, 0);
+            __atomic_store_n(&position, x + 1, __ATOMIC_RELAXED);
+            if(m->steps[x].delay_us && wait_cancelled(m->steps[x].delay_us)) break;
+        }
+        // Never leave a key held down if cancelled mid tap
+        if(x < m->count){
+            hid_writer_queue(released, MACRO_REPORT_SIZE, 0);
+        }
+
+        pthread_mutex_lock(&player_mutex);
+        playing = -1;
+        cancelled = 0;
+        finished = 1;
+        key_ring_notify(&key_events);
+    }
+    pthread_mutex_unlock(&player_mutex);
+    return NULL;
+}
+
+static int start_player(){
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&player_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    player_running = 1;
+    if(pthread_create(&t_macro_player, NULL, run_macro_player, NULL)){
+        printf("Error creating macro player thread.\n");
+        player_running = 0;
+        return 1;
+    }
+    player_started = 1;
+    return 0;
+}
+
+/*
+    Returns 0 if another macro is still playing.
+    Trace replays play the macro there and then on the simulated clock.
+*/
+int macro_play(int id){
+    if(id < 0 || id >= MACRO_MAX || macros[id].allocated == 0) return 0;
+
+    if(clock_simulated){
+        unsigned int x;
+        for(x = 0; x < macros[id].count; x++){
+            hid_writer_queue(macros[id].steps[x].report, MACRO_REPORT_SIZE, 0);
+            delay_us(macros[id].steps[x].delay_us);
+        }
+        position = macros[id].count;
+        finished = 1;
+        return 1;
+    }
+
+    if(!player_started && start_player() != 0) return 0;
+
+    pthread_mutex_lock(&player_mutex);
+    if(playing != -1){
+        pthread_mutex_unlock(&player_mutex);
+        return 0;
+    }
+    playing = id;
+    position = 0;
+    finished = 0;
+    pthread_cond_signal(&player_cond);
+    pthread_mutex_unlock(&player_mutex);
+    return 1;
+}
+
+void macro_cancel(){
+    pthread_mutex_lock(&player_mutex);
+    if(playing != -1){
+        cancelled = 1;
+        pthread_cond_signal(&player_cond);
+    }
+    pthread_mutex_unlock(&player_mutex);
+}
+
+/* Returns 1 while playing, with how far through the macro it is */
+int macro_progress(unsigned int *step, unsigned int *count){
+    pthread_mutex_lock(&player_mutex);
+    int id = playing;
+    *step = __atomic_load_n(&position, __ATOMIC_RELAXED);
+    *count = id == -1 ? *step : macros[id].count;
+    pthread_mutex_unlock(&player_mutex);
+    return id != -1;
+}
+
+/* Returns 1 once after each macro finishes, so the live report can be restored */
+int macro_take_finished(){
+    pthread_mutex_lock(&player_mutex);
+    int ret = finished;
+    finished = 0;
+    pthread_mutex_unlock(&player_mutex);
+    return ret;
+}
+
+void macro_stop(){
+    if(!player_started) return;
+    macro_cancel();
+    pthread_mutex_lock(&player_mutex);
+    player_running = 0;
+    pthread_cond_signal(&player_cond);
+    pthread_mutex_unlock(&player_mutex);
+    pthread_join(t_macro_player, NULL);
+    player_started = 0;
+
+    int x;
+    for(x = 0; x < MACRO_MAX; x++){
+        macro_free(x);
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <pthread.h>
+
+/*
+    Macros are compiled once into a flat buffer of boot keyboard
+    reports, each followed by an optional delay, and streamed to the
+    HID writer by a player thread so key scanning and Lua carry on
+    while they type. Only one macro plays at a time.
+*/
+
+#define MACRO_MAX 32
+#define MACRO_REPORT_SIZE 16 // Boot keyboard report, see HID_REPORT_SIZE
+
+typedef struct macro_step {
+    unsigned char report[MACRO_REPORT_SIZE];
+    unsigned int delay_us;          // Pause after sending the report
+} macro_step;
+
+typedef struct macro {
+    macro_step *steps;
+    unsigned int count;
+    unsigned int allocated;
+} macro;
+
+macro macros[MACRO_MAX];
+
+int macro_new();
+int macro_add_report(int id, unsigned char modifiers, unsigned char hid_code);
+int macro_add_delay(int id, unsigned int delay_us);
+int macro_free(int id);
+int macro_play(int id);
+void macro_cancel();
+int macro_progress(unsigned int *step, unsigned int *count);
+int macro_take_finished();
+void macro_stop();
@@ -0,0 +1,128 @@
+#include "midi-clock.h"
+#include "key-ring.h"
+#include <math.h>
+#include <pthread.h>
+
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int running = 0;
+static int good_ticks = 0;
+static unsigned long ticks = 0;         // Ticks since start
+static double t0 = 0, t1 = 0;           // Filtered times of the last and next tick
+static double period = 0;               // Filtered tick period, in microseconds
+static unsigned long long last_tick_us = 0;
+static unsigned long beat_count = 0;
+static int beat_pending = 0;
+
+/*
+    Second order DLL, see Fons Adriaensen's "Using a DLL to filter time".
+    The coefficients depend on the period, so they're worked out per tick.
+    Returns 1 if the tick was a glitch and the loop was restarted.
+*/
+static int dll_update(double now){
+    double omega = 2 * M_PI * MIDI_CLOCK_BANDWIDTH * period / 1000000.0;
+    double b = sqrt(2) * omega;
+    double c = omega * omega;
+    double e = now - t1;
+
+    // A tick way off the prediction is a glitch or a tempo jump, start over
+    if(fabs(e) > period / 2){
+        period = now - last_tick_us;
+        t0 = now;
+        t1 = now + period;
+        good_ticks = 1;
+        return 1;
+    }
+    t0 = t1;
+    t1 += b * e + period;
+    period += c * e;
+    return 0;
+}
+
+void midi_clock_tick(unsigned long long now){
+    pthread_mutex_lock(&clock_mutex);
+    if(last_tick_us == 0 || now - last_tick_us > MIDI_CLOCK_TIMEOUT_US){
+        good_ticks = 0;
+    }
+
+    if(good_ticks == 0){
+        // Unlocked, restart the loop from the raw interval
+        if(last_tick_us && now - last_tick_us <= MIDI_CLOCK_TIMEOUT_US){
+            period = now - last_tick_us;
+            t0 = now;
+            t1 = now + period;
+            good_ticks = 1;
+        }
+    }
+    else if(!dll_update(now)){
+        if(good_ticks < MIDI_CLOCK_LOCK_TICKS) good_ticks++;
+    }
+    last_tick_us = now;
+
+    if(running){
+        ticks++;
+        if(ticks % MIDI_CLOCK_PPQN == 0){
+            beat_count = ticks / MIDI_CLOCK_PPQN;
+            beat_pending = 1;
+            key_ring_notify(&key_events);
+        }
+    }
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+/* The first tick after start is the first beat, so counting starts one short */
+void midi_clock_start(){
+    pthread_mutex_lock(&clock_mutex);
+    running = 1;
+    ticks = -1;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+void midi_clock_continue(){
+    pthread_mutex_lock(&clock_mutex);
+    running = 1;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+void midi_clock_stop(){
+    pthread_mutex_lock(&clock_mutex);
+    running = 0;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+/* Song position pointer, in sixteenth notes of 6 ticks each */
+void midi_clock_set_position(unsigned int sixteenths){
+    pthread_mutex_lock(&clock_mutex);
+    ticks = sixteenths * (MIDI_CLOCK_PPQN / 4) - 1;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+void midi_clock_get(unsigned long long now, midi_clock_state *state){
+    pthread_mutex_lock(&clock_mutex);
+    state->running = running;
+    // now is read before the lock, so a tick may have landed after it
+    unsigned long long since = now < last_tick_us ? 0 : now - last_tick_us;
+    state->locked = good_ticks >= MIDI_CLOCK_LOCK_TICKS && since <= MIDI_CLOCK_TIMEOUT_US;
+    state->bpm = state->locked ? 60000000.0 / (period * MIDI_CLOCK_PPQN) : 0;
+
+    // Interpolate between ticks from the filtered times rather than the raw ones
+    double fraction = 0;
+    if(state->locked && t1 > t0){
+        fraction = (now - t0) / (t1 - t0);
+        if(fraction < 0) fraction = 0;
+        if(fraction > 0.999) fraction = 0.999;
+    }
+    long current = (long)ticks;
+    state->beat = current < 0 ? 0 : (current + fraction) / MIDI_CLOCK_PPQN;
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+/* Lua thread side. Returns 1, and the beat number, once per beat */
+int midi_clock_take_beat(unsigned long *beat){
+    pthread_mutex_lock(&clock_mutex);
+    int ret = beat_pending;
+    beat_pending = 0;
+    *beat = beat_count;
+    pthread_mutex_unlock(&clock_mutex);
+    return ret;
+}
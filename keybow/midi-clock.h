@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+    Follows the host's MIDI clock (24 ticks per beat). Tick times are
+    smoothed by a delay-locked loop, so the jitter USB adds to each
+    tick doesn't reach the tempo or the beat phase that lights and Lua
+    are timed from.
+*/
+
+#define MIDI_CLOCK_PPQN 24
+#define MIDI_CLOCK_LOCK_TICKS 6      // Ticks before the tempo is trusted
+#define MIDI_CLOCK_BANDWIDTH 0.5     // Loop bandwidth in Hz, lower filters more jitter but follows tempo changes slower
+#define MIDI_CLOCK_TIMEOUT_US 500000 // No tick for this long and the clock is lost
+
+typedef struct midi_clock_state {
+    int running;            // Between start/continue and stop
+    int locked;             // Enough regular ticks to trust the tempo
+    double bpm;
+    double beat;            // Beats since start, the fraction is the phase within the beat
+} midi_clock_state;
+
+void midi_clock_tick(unsigned long long now);
+void midi_clock_start();
+void midi_clock_continue();
+void midi_clock_stop();
+void midi_clock_set_position(unsigned int sixteenths);
+void midi_clock_get(unsigned long long now, midi_clock_state *state);
+int midi_clock_take_beat(unsigned long *beat);
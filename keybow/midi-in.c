@@ -0,0 +1,312 @@
+#include "midi-in.h"
+#include "key-ring.h"
+#include "lights.h"
+#include "midi-clock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+typedef struct note_light {
+    unsigned char enabled;
+    unsigned char pixel;
+    unsigned char r, g, b;
+} note_light;
+
+static midi_event ring[MIDI_RING_SIZE];
+static unsigned int ring_head = 0;      // Written by the reader thread only
+static unsigned int ring_tail = 0;      // Written by the Lua thread only
+
+static unsigned char sysex_slots[MIDI_SYSEX_SLOTS][MIDI_SYSEX_MAX];
+static unsigned int sysex_head = 0;
+static unsigned int sysex_tail = 0;
+
+static note_light note_lights[128];
+
+static midi_parser parser;
+static pthread_t t_midi_in;
+static int reader_fd = -1;
+static int wake_fd = -1;
+
+static int ring_full(){
+    return ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= MIDI_RING_SIZE;
+}
+
+static void push(const midi_event *event){
+    if(ring_full()){
+        midi_in_stats.overflows++;
+        return;
+    }
+    ring[ring_head & (MIDI_RING_SIZE - 1)] = *event;
+    __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    midi_in_stats.received++;
+}
+
+static void push_sysex(){
+    midi_event event = {.status = MIDI_SYSEX, .length = parser.sysex_length};
+    unsigned int tail = __atomic_load_n(&sysex_tail, __ATOMIC_ACQUIRE);
+    if(sysex_head - tail >= MIDI_SYSEX_SLOTS || ring_full()){
+        midi_in_stats.overflows++;
+        return;
+    }
+    event.data1 = sysex_head % MIDI_SYSEX_SLOTS;
+    memcpy(sysex_slots[event.data1], parser.sysex, parser.sysex_length);
+    sysex_head++;
+    push(&event);
+}
+
+/* Straight from the reader thread, so DAW feedback doesn't wait for Lua */
+static void light_note(unsigned char note, unsigned char velocity){
+    note_light *light = &note_lights[note & 0x7f];
+    if(!__atomic_load_n(&light->enabled, __ATOMIC_ACQUIRE)) return;
+    if(velocity == 0){
+        lights_setOverlay(light->pixel, 0, 0, 0, 0);
+        return;
+    }
+    lights_setOverlay(light->pixel, 1,
+        light->r * velocity / 127, light->g * velocity / 127, light->b * velocity / 127);
+}
+
+static void dispatch(unsigned char status, unsigned char data1, unsigned char data2){
+    midi_event event = {.status = status, .data1 = data1, .data2 = data2};
+    if(status == MIDI_SONG_POSITION){
+        midi_clock_set_position(data1 | (data2 << 7));
+    }
+    if(status < 0xF0){
+        event.status = status & 0xF0;
+        event.channel = status & 0x0F;
+        // Note on with no velocity is a note off
+        if(event.status == MIDI_NOTE_ON && data2 == 0){
+            event.status = MIDI_NOTE_OFF;
+        }
+        if(event.status == MIDI_NOTE_ON){
+            light_note(data1, data2);
+        }
+        else if(event.status == MIDI_NOTE_OFF){
+            light_note(data1, 0);
+        }
+    }
+    push(&event);
+}
+
+static int data_bytes(unsigned char status){
+    switch(status & 0xF0){
+        case MIDI_PROGRAM_CHANGE:
+        case MIDI_CHANNEL_PRESSURE:
+            return 1;
+        case 0xF0:
+            if(status == 0xF1 || status == MIDI_SONG_SELECT) return 1;
+            if(status == MIDI_SONG_POSITION) return 2;
+            return 0;
+    }
+    return 2;
+}
+
+static void end_sysex(){
+    if(parser.sysex_length < MIDI_SYSEX_MAX){
+        parser.sysex[parser.sysex_length++] = MIDI_SYSEX_END;
+    }
+    parser.in_sysex = 0;
+    push_sysex();
+}
+
+void midi_parse(unsigned char byte){
+    // Real-time bytes can turn up anywhere, even inside SysEx, and leave everything else alone
+    if(byte >= MIDI_CLOCK){
+        switch(byte){
+            case MIDI_CLOCK:
+                midi_clock_tick(micros());
+                return;
+            case MIDI_START:
+                midi_clock_start();
+                break;
+            case MIDI_CONTINUE:
+                midi_clock_continue();
+                break;
+            case MIDI_STOP:
+                midi_clock_stop();
+                break;
+            default:
+                return;
+        }
+        dispatch(byte, 0, 0);
+        return;
+    }
+
+    if(byte & 0x80){
+        // Any other status byte ends SysEx, whether or not it's F7
+        if(parser.in_sysex){
+            end_sysex();
+            if(byte == MIDI_SYSEX_END) return;
+        }
+        if(byte == MIDI_SYSEX){
+            parser.in_sysex = 1;
+            parser.sysex[0] = byte;
+            parser.sysex_length = 1;
+            parser.sysex_truncated = 0;
+            parser.status = 0;
+            return;
+        }
+        // System common messages cancel running status
+        parser.status = byte;
+        parser.count = 0;
+        parser.expected = data_bytes(byte);
+        if(parser.expected == 0){
+            if(byte != MIDI_SYSEX_END) dispatch(byte, 0, 0);
+            parser.status = 0;
+        }
+        return;
+    }
+
+    if(parser.in_sysex){
+        // The last byte is kept for F7
+        if(parser.sysex_length < MIDI_SYSEX_MAX - 1){
+            parser.sysex[parser.sysex_length++] = byte;
+        } else if(!parser.sysex_truncated){
+            parser.sysex_truncated = 1;
+            midi_in_stats.truncated++;
+        }
+        return;
+    }
+
+    if(parser.status == 0){
+        return; // Data with no status to go with it
+    }
+
+    parser.data[parser.count++] = byte;
+    if(parser.count < parser.expected){
+        return;
+    }
+    dispatch(parser.status, parser.data[0], parser.expected > 1 ? parser.data[1] : 0);
+    parser.count = 0;
+    if(parser.status >= 0xF0){
+        parser.status = 0;
+    }
+}
+
+#ifdef KEYBOW_MIDI_FIFO
+static int open_reader(int fd){
+    if(mkfifo(KEYBOW_MIDI_FIFO, 0666) != 0 && errno != EEXIST){
+        printf("Error creating %s\n", KEYBOW_MIDI_FIFO);
+        return -1;
+    }
+    printf("Simulating MIDI input on %s\n", KEYBOW_MIDI_FIFO);
+    return open(KEYBOW_MIDI_FIFO, O_RDWR | O_NONBLOCK);
+}
+#else
+static int open_reader(int fd){
+    return fd;
+}
+#endif
+
+static void *run_midi_in(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct pollfd pfds[2] = {
+        {.fd = reader_fd, .events = POLLIN},
+        {.fd = wake_fd, .events = POLLIN}
+    };
+    unsigned char buf[64];
+
+    while(1){
+        if(poll(pfds, 2, -1) <= 0){
+            continue;
+        }
+        if(pfds[1].revents & POLLIN){
+            break;
+        }
+        if(pfds[0].revents & (POLLERR | POLLHUP)){
+            break;
+        }
+        unsigned int head = ring_head;
+        int length, x;
+        while((length = read(reader_fd, buf, sizeof(buf))) > 0){
+            for(x = 0; x < length; x++){
+                midi_parse(buf[x]);
+            }
+        }
+        if(ring_head != head){
+            key_ring_notify(&key_events);
+        }
+        if(length == 0){
+            break; // End of file, nothing more will ever arrive
+        }
+    }
+    return NULL;
+}
+
+int midi_in_start(int fd){
+    memset(&parser, 0, sizeof(parser));
+    reader_fd = open_reader(fd);
+    if(reader_fd == -1){
+        printf("Error opening MIDI input\n");
+        return 1;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(wake_fd == -1){
+        return 1;
+    }
+    fcntl(reader_fd, F_SETFL, fcntl(reader_fd, F_GETFL) | O_NONBLOCK);
+    if(pthread_create(&t_midi_in, NULL, run_midi_in, NULL)){
+        printf("Error creating MIDI input thread.\n");
+        close(wake_fd);
+        wake_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Lua thread side. Returns 0 if nothing is waiting. SysEx data stays
+    valid until midi_in_release_sysex(), which must follow each one.
+*/
+int midi_in_pop(midi_event *event, unsigned char **sysex){
+    unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    if(head == ring_tail){
+        return 0;
+    }
+    *event = ring[ring_tail & (MIDI_RING_SIZE - 1)];
+    __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+    if(event->status == MIDI_SYSEX){
+        *sysex = sysex_slots[event->data1];
+    }
+    return 1;
+}
+
+void midi_in_release_sysex(){
+    __atomic_store_n(&sysex_tail, sysex_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Lights pixel in r, g, b scaled by velocity while note is on, a negative pixel unmaps it */
+void midi_in_map_note(unsigned char note, int pixel, int r, int g, int b){
+    note_light *light = &note_lights[note & 0x7f];
+    if(__atomic_load_n(&light->enabled, __ATOMIC_ACQUIRE)){
+        lights_setOverlay(light->pixel, 0, 0, 0, 0);
+    }
+    __atomic_store_n(&light->enabled, 0, __ATOMIC_RELEASE);
+    if(pixel < 0 || pixel >= NUM_PIXELS) return;
+    light->pixel = pixel;
+    light->r = r;
+    light->g = g;
+    light->b = b;
+    __atomic_store_n(&light->enabled, 1, __ATOMIC_RELEASE);
+}
+
+void midi_in_stop(){
+    uint64_t one = 1;
+    if(wake_fd == -1) return;
+    write(wake_fd, &one, sizeof(one));
+    pthread_join(t_midi_in, NULL);
+    close(wake_fd);
+    wake_fd = -1;
+#ifdef KEYBOW_MIDI_FIFO
+    close(reader_fd);
+#endif
+    reader_fd = -1;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+    MIDI input from the USB MIDI function. A reader thread parses the
+    byte stream (running status, real-time bytes in the middle of other
+    messages, SysEx) and queues complete messages for the Lua thread,
+    waking it through the key ring. Notes can also light keys directly
+    from the reader thread, without waiting on Lua.
+
+    Building with KEYBOW_MIDI_FIFO reads raw MIDI bytes from a named
+    pipe instead:
+
+        printf '\x90\x3c\x7f' > /tmp/keybow-midi    # Note on, middle C
+*/
+
+#define MIDI_RING_SIZE 128      // Must be a power of two
+#define MIDI_SYSEX_SLOTS 4
+#define MIDI_SYSEX_MAX 256
+
+#define MIDI_NOTE_OFF         0x80
+#define MIDI_NOTE_ON          0x90
+#define MIDI_POLY_AFTERTOUCH  0xA0
+#define MIDI_CONTROL_CHANGE   0xB0
+#define MIDI_PROGRAM_CHANGE   0xC0
+#define MIDI_CHANNEL_PRESSURE 0xD0
+#define MIDI_PITCH_BEND       0xE0
+#define MIDI_SYSEX            0xF0
+#define MIDI_SONG_POSITION    0xF2
+#define MIDI_SONG_SELECT      0xF3
+#define MIDI_SYSEX_END        0xF7
+#define MIDI_CLOCK            0xF8
+#define MIDI_START            0xFA
+#define MIDI_CONTINUE         0xFB
+#define MIDI_STOP             0xFC
+
+typedef struct midi_event {
+    unsigned char status;   // Channel messages have the channel masked off
+    unsigned char channel;
+    unsigned char data1;    // SysEx: slot in midi_sysex
+    unsigned char data2;
+    unsigned short length;  // SysEx: bytes in the slot, including F0/F7
+} midi_event;
+
+typedef struct midi_parser {
+    unsigned char status;   // Running status, 0 if none
+    unsigned char data[2];
+    int count;
+    int expected;
+    int in_sysex;
+    int sysex_truncated;
+    unsigned char sysex[MIDI_SYSEX_MAX];
+    int sysex_length;
+} midi_parser;
+
+typedef struct midi_stats {
+    unsigned long received;     // Complete messages
+    unsigned long overflows;    // Messages dropped because Lua fell behind
+    unsigned long truncated;    // SysEx longer than MIDI_SYSEX_MAX
+} midi_stats;
+
+midi_stats midi_in_stats;
+
+void midi_parse(unsigned char byte);
+int midi_in_start(int fd);
+int midi_in_pop(midi_event *event, unsigned char **sysex);
+void midi_in_release_sysex();
+void midi_in_map_note(unsigned char note, int pixel, int r, int g, int b);
+void midi_in_stop();
@@ -0,0 +1,131 @@
+#include "midi-out.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct midi_out_port {
+    int fd;
+    unsigned char buf[MIDI_OUT_BUFFER];
+    int length;
+    unsigned char running_status;
+    midi_out_stats stats;
+} midi_out_port;
+
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static midi_out_port ports[MIDI_MAX_PORTS] = {
+    {.fd = -1}, {.fd = -1}, {.fd = -1}, {.fd = -1}
+};
+
+/* Messages for a port that was never opened go to port 0 */
+static midi_out_port *get_port(int port){
+    if(port < 0 || port >= MIDI_MAX_PORTS || ports[port].fd == -1) return &ports[0];
+    return &ports[port];
+}
+
+void midi_out_init(int port, int fd){
+    if(port < 0 || port >= MIDI_MAX_PORTS) return;
+    pthread_mutex_lock(&out_mutex);
+    memset(&ports[port], 0, sizeof(midi_out_port));
+    ports[port].fd = fd;
+    pthread_mutex_unlock(&out_mutex);
+}
+
+/* Called with out_mutex held */
+static void write_port(midi_out_port *port, const unsigned char *data, int length){
+    int written = write(port->fd, data, length);
+    port->stats.writes++;
+    if(written != length){
+        // Short writes and EAGAIN both mean the gadget's request queue is backed up
+        if(written >= 0 || errno == EAGAIN) port->stats.queue_full++;
+        port->stats.dropped += length - (written > 0 ? written : 0);
+        // The receiver may have lost the status byte, so send it again next time
+        port->running_status = 0;
+    }
+}
+
+static void flush_locked(midi_out_port *port){
+    if(port->length == 0) return;
+    write_port(port, port->buf, port->length);
+    port->length = 0;
+}
+
+static int data_bytes(unsigned char status){
+    switch(status & 0xF0){
+        case 0xC0: // Program change
+        case 0xD0: // Channel pressure
+            return 1;
+        case 0xF0:
+            if(status == 0xF1 || status == 0xF3) return 1;
+            if(status == 0xF2) return 2;
+            return 0;
+    }
+    return 2;
+}
+
+void midi_out_message(int port_index, unsigned char status, unsigned char data1, unsigned char data2){
+    int count = data_bytes(status);
+    pthread_mutex_lock(&out_mutex);
+    midi_out_port *port = get_port(port_index);
+    if(port->length + 1 + count > MIDI_OUT_BUFFER){
+        flush_locked(port);
+    }
+    if(status >= 0xF8){
+        // Real-time messages leave running status alone
+    }
+    else if(status == port->running_status){
+        port->stats.status_saved++;
+        status = 0;
+    }
+    else {
+        port->running_status = status < 0xF0 ? status : 0;
+    }
+    if(status) port->buf[port->length++] = status;
+    if(count > 0) port->buf[port->length++] = data1 & 0x7f;
+    if(count > 1) port->buf[port->length++] = data2 & 0x7f;
+    port->stats.messages++;
+    pthread_mutex_unlock(&out_mutex);
+}
+
+/* data runs from F0 to F7 inclusive */
+void midi_out_sysex(int port_index, const unsigned char *data, int length){
+    pthread_mutex_lock(&out_mutex);
+    midi_out_port *port = get_port(port_index);
+    if(port->length + length > MIDI_OUT_BUFFER){
+        flush_locked(port);
+    }
+    if(length > MIDI_OUT_BUFFER){
+        write_port(port, data, length);
+    }
+    else {
+        memcpy(port->buf + port->length, data, length);
+        port->length += length;
+    }
+    port->running_status = 0;
+    port->stats.messages++;
+    pthread_mutex_unlock(&out_mutex);
+}
+
+void midi_out_flush(){
+    int x;
+    pthread_mutex_lock(&out_mutex);
+    for(x = 0; x < MIDI_MAX_PORTS; x++){
+        if(ports[x].fd != -1) flush_locked(&ports[x]);
+    }
+    pthread_mutex_unlock(&out_mutex);
+}
+
+/* Counters for one port, or summed over all of them when port is -1 */
+void midi_out_get_stats(int port, midi_out_stats *stats){
+    int x;
+    memset(stats, 0, sizeof(midi_out_stats));
+    pthread_mutex_lock(&out_mutex);
+    for(x = 0; x < MIDI_MAX_PORTS; x++){
+        if(port != -1 && port != x) continue;
+        stats->messages += ports[x].stats.messages;
+        stats->writes += ports[x].stats.writes;
+        stats->status_saved += ports[x].stats.status_saved;
+        stats->dropped += ports[x].stats.dropped;
+        stats->queue_full += ports[x].stats.queue_full;
+    }
+    pthread_mutex_unlock(&out_mutex);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <pthread.h>
+
+/*
+    MIDI messages are collected in a buffer per port and written out
+    with a single write() per main loop pass, so a chord or a bank of
+    CCs costs one syscall. Repeated status bytes are left out (running
+    status). Safe to call from any thread.
+*/
+
+#define MIDI_OUT_BUFFER 512
+#define MIDI_MAX_PORTS 4
+
+typedef struct midi_out_stats {
+    unsigned long messages;
+    unsigned long writes;
+    unsigned long status_saved; // Status bytes left out thanks to running status
+    unsigned long dropped;      // Bytes the MIDI device didn't take
+    unsigned long queue_full;   // Writes that found the device's queue full
+} midi_out_stats;
+
+void midi_out_init(int port, int fd);
+void midi_out_message(int port, unsigned char status, unsigned char data1, unsigned char data2);
+void midi_out_sysex(int port, const unsigned char *data, int length);
+void midi_out_flush();
+void midi_out_get_stats(int port, midi_out_stats *stats);
@@ -0,0 +1,222 @@
+#include "mouse.h"
+#include "hid-writer.h"
+#include "lights.h"
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+static pthread_t t_mouse;
+static pthread_mutex_t mouse_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mouse_cond = PTHREAD_COND_INITIALIZER;
+static int mouse_started = 0;
+static int mouse_running = 0;
+static unsigned int frame_us = HID_REPORT_INTERVAL_US;
+
+static unsigned char buttons = 0;
+static int dir_x = 0, dir_y = 0;        // Sum of held direction keys
+static int wheel_v = 0, wheel_h = 0;    // Sum of held wheel keys
+static int scroll_v = 0, scroll_h = 0;  // One-off wheel steps
+static float acc_x = 0, acc_y = 0, acc_v = 0, acc_h = 0;
+static unsigned long long held_since = 0;
+
+static float speed = MOUSE_DEFAULT_SPEED;
+static float max_speed = MOUSE_DEFAULT_MAX_SPEED;
+static unsigned int accel_us = MOUSE_DEFAULT_ACCEL_MS * 1000;
+static float wheel_speed = MOUSE_DEFAULT_WHEEL;
+
+static int is_idle(){
+    return dir_x == 0 && dir_y == 0
+        && wheel_v == 0 && wheel_h == 0 && scroll_v == 0 && scroll_h == 0;
+}
+
+static signed char clamp(int value){
+    if(value > 127) return 127;
+    if(value < -127) return -127;
+    return value;
+}
+
+/* Takes the whole pixels out of an accumulator, leaving the fraction */
+static int take(float *acc){
+    float whole = truncf(*acc);
+    if(whole > 127) whole = 127;
+    if(whole < -127) whole = -127;
+    *acc -= whole;
+    return (int)whole;
+}
+
+/* Speed ramps up along a quadratic ease-in for as long as keys are held */
+static float current_speed(unsigned long long now){
+    if(accel_us == 0) return max_speed;
+    float t = (float)(now - held_since) / accel_us;
+    if(t > 1) t = 1;
+    return speed + (max_speed - speed) * t * t;
+}
+
+/* Called with mouse_mutex held, returns 1 if report needs sending */
+static int mouse_frame(unsigned char *report, float dt, unsigned long long now){
+    if(dir_x || dir_y){
+        float length = sqrtf(dir_x * dir_x + dir_y * dir_y);
+        float distance = current_speed(now) * dt / length;
+        acc_x += dir_x * distance;
+        acc_y += dir_y * distance;
+    }
+    acc_v += wheel_v * wheel_speed * dt;
+    acc_h += wheel_h * wheel_speed * dt;
+
+    report[0] = 4; // report id
+    report[1] = buttons;
+    report[2] = clamp(take(&acc_x));
+    report[3] = clamp(take(&acc_y));
+    report[4] = clamp(take(&acc_v) + scroll_v);
+    report[5] = clamp(take(&acc_h) + scroll_h);
+    scroll_v = scroll_h = 0;
+
+    return report[2] || report[3] || report[4] || report[5];
+}
+
+static void *run_mouse(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    unsigned char report[MOUSE_REPORT_SIZE];
+    unsigned long long last_us = micros();
+
+    pthread_mutex_lock(&mouse_mutex);
+    while(mouse_running){
+        if(is_idle()){
+            pthread_cond_wait(&mouse_cond, &mouse_mutex);
+            last_us = micros();
+            continue;
+        }
+        unsigned long long now = micros();
+        int send = mouse_frame(report, (now - last_us) / 1000000.0f, now);
+        last_us = now;
+        // Queued under the lock so a click can't slip in ahead of stale buttons
+        if(send) hid_writer_queue(report, MOUSE_REPORT_SIZE, 0);
+        pthread_mutex_unlock(&mouse_mutex);
+
+        usleep(frame_us);
+
+        pthread_mutex_lock(&mouse_mutex);
+    }
+    pthread_mutex_unlock(&mouse_mutex);
+    return NULL;
+}
+
+void mouse_init(unsigned int interval_us){
+    frame_us = interval_us;
+}
+
+/*
+    Trace replays have no integrator thread, wheel reports go out
+    straight away and held direction keys don't move anything.
+*/
+static void wake(){
+    if(clock_simulated){
+        unsigned char report[MOUSE_REPORT_SIZE];
+        if(mouse_frame(report, 0, micros())){
+            hid_writer_queue(report, MOUSE_REPORT_SIZE, 0);
+        }
+        return;
+    }
+    if(!mouse_started){
+        mouse_running = 1;
+        if(pthread_create(&t_mouse, NULL, run_mouse, NULL)){
+            printf("Error creating mouse thread.\n");
+            mouse_running = 0;
+            return;
+        }
+        mouse_started = 1;
+    }
+    pthread_cond_signal(&mouse_cond);
+}
+
+/* Clicks skip the integrator so a quick tap can't fall between two frames */
+void mouse_set_button(unsigned short button, unsigned short state){
+    unsigned char report[MOUSE_REPORT_SIZE] = {4, 0, 0, 0, 0, 0};
+    if(button > MOUSE_BUTTON_FORWARD) return;
+    pthread_mutex_lock(&mouse_mutex);
+    unsigned char old = buttons;
+    buttons &= ~(1 << button);
+    buttons |= ((state ? 1 : 0) << button);
+    report[1] = buttons;
+    if(report[1] != old){
+        hid_writer_queue(report, MOUSE_REPORT_SIZE, 0);
+    }
+    pthread_mutex_unlock(&mouse_mutex);
+}
+
+void mouse_push_direction(int dx, int dy, unsigned short pressed){
+    pthread_mutex_lock(&mouse_mutex);
+    if(dir_x == 0 && dir_y == 0){
+        held_since = micros();
+    }
+    if(pressed){
+        dir_x += dx;
+        dir_y += dy;
+    }
+    else {
+        dir_x -= dx;
+        dir_y -= dy;
+    }
+    if(dir_x == 0 && dir_y == 0){
+        acc_x = acc_y = 0;
+    }
+    wake();
+    pthread_mutex_unlock(&mouse_mutex);
+}
+
+void mouse_push_wheel(int dv, int dh, unsigned short pressed){
+    pthread_mutex_lock(&mouse_mutex);
+    if(pressed){
+        wheel_v += dv;
+        wheel_h += dh;
+        // The first step goes out on the press, so a tap always scrolls
+        scroll_v += dv;
+        scroll_h += dh;
+    }
+    else {
+        wheel_v -= dv;
+        wheel_h -= dh;
+    }
+    if(wheel_v == 0 && wheel_h == 0){
+        acc_v = acc_h = 0;
+    }
+    wake();
+    pthread_mutex_unlock(&mouse_mutex);
+}
+
+void mouse_scroll(int v, int h){
+    pthread_mutex_lock(&mouse_mutex);
+    scroll_v += v;
+    scroll_h += h;
+    wake();
+    pthread_mutex_unlock(&mouse_mutex);
+}
+
+void mouse_set_acceleration(float new_speed, float new_max_speed, unsigned int accel_ms, float new_wheel_speed){
+    pthread_mutex_lock(&mouse_mutex);
+    speed = new_speed;
+    max_speed = new_max_speed < new_speed ? new_speed : new_max_speed;
+    accel_us = accel_ms * 1000;
+    wheel_speed = new_wheel_speed;
+    pthread_mutex_unlock(&mouse_mutex);
+}
+
+void mouse_stop(){
+    if(!mouse_started) return;
+    pthread_mutex_lock(&mouse_mutex);
+    mouse_running = 0;
+    pthread_cond_signal(&mouse_cond);
+    pthread_mutex_unlock(&mouse_mutex);
+    pthread_join(t_mouse, NULL);
+    mouse_started = 0;
+
+    if(buttons){
+        unsigned char report[MOUSE_REPORT_SIZE] = {4, 0, 0, 0, 0, 0};
+        buttons = 0;
+        hid_writer_queue(report, MOUSE_REPORT_SIZE, 0);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+    Mouse keys. Held keys add a direction, the integrator thread turns
+    it into motion along an acceleration curve and sends at most one
+    movement report per HID interval, carrying over fractional pixels
+    so slow moves stay smooth.
+*/
+
+#define MOUSE_REPORT_SIZE 6 // id, buttons, x, y, wheel, pan
+
+#define MOUSE_BUTTON_LEFT    0
+#define MOUSE_BUTTON_RIGHT   1
+#define MOUSE_BUTTON_MIDDLE  2
+#define MOUSE_BUTTON_BACK    3
+#define MOUSE_BUTTON_FORWARD 4
+
+#define MOUSE_DEFAULT_SPEED     200  // Pixels per second when a key goes down
+#define MOUSE_DEFAULT_MAX_SPEED 1200 // Pixels per second once fully accelerated
+#define MOUSE_DEFAULT_ACCEL_MS  1000 // Time to reach full speed
+#define MOUSE_DEFAULT_WHEEL     10   // Wheel steps per second
+
+void mouse_init(unsigned int interval_us);
+void mouse_set_button(unsigned short button, unsigned short state);
+void mouse_push_direction(int dx, int dy, unsigned short pressed);
+void mouse_push_wheel(int dv, int dh, unsigned short pressed);
+void mouse_scroll(int v, int h);
+void mouse_set_acceleration(float speed, float max_speed, unsigned int accel_ms, float wheel_speed);
+void mouse_stop();
@@ -0,0 +1,119 @@
+#include "pattern-cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static pattern_entry entries[PATTERN_CACHE_MAX];
+static pattern_entry *active = NULL;
+static size_t budget = PATTERN_CACHE_DEFAULT_BUDGET;
+static unsigned long use_count = 0;
+
+static void free_entry(pattern_entry *entry){
+    free(entry->name);
+    free(entry->frames);
+    pattern_cache_total.bytes -= entry->bytes;
+    pattern_cache_total.entries--;
+    memset(entry, 0, sizeof(pattern_entry));
+}
+
+/* Least recently used entry that isn't on show, or NULL */
+static pattern_entry *oldest(){
+    pattern_entry *found = NULL;
+    int x;
+    for(x = 0; x < PATTERN_CACHE_MAX; x++){
+        if(entries[x].name == NULL || &entries[x] == active) continue;
+        if(found == NULL || entries[x].last_used < found->last_used){
+            found = &entries[x];
+        }
+    }
+    return found;
+}
+
+static void evict(){
+    while(pattern_cache_total.bytes > budget){
+        pattern_entry *entry = oldest();
+        if(entry == NULL) return;
+        free_entry(entry);
+        pattern_cache_total.evictions++;
+    }
+}
+
+pattern_entry *pattern_cache_find(const char *name){
+    int x;
+    for(x = 0; x < PATTERN_CACHE_MAX; x++){
+        if(entries[x].name != NULL && strcmp(entries[x].name, name) == 0){
+            entries[x].last_used = ++use_count;
+            pattern_cache_total.hits++;
+            return &entries[x];
+        }
+    }
+    pattern_cache_total.misses++;
+    return NULL;
+}
+
+/*
+    Takes ownership of frames, returns NULL (having freed them) if out of
+    memory. If the same file was cached in the meantime, eg: loaded twice
+    in the background, the copy already there is kept.
+*/
+pattern_entry *pattern_cache_insert(const char *name, char *frames, int frame_count, int width, int height, size_t bytes){
+    pattern_entry *entry = NULL;
+    int x;
+    for(x = 0; x < PATTERN_CACHE_MAX; x++){
+        if(entries[x].name != NULL && strcmp(entries[x].name, name) == 0){
+            free(frames);
+            entries[x].last_used = ++use_count;
+            return &entries[x];
+        }
+    }
+    for(x = 0; x < PATTERN_CACHE_MAX; x++){
+        if(entries[x].name == NULL){
+            entry = &entries[x];
+            break;
+        }
+    }
+    // Every slot full, make room whatever the budget says
+    if(entry == NULL){
+        entry = oldest();
+        if(entry == NULL){
+            free(frames);
+            return NULL;
+        }
+        free_entry(entry);
+        pattern_cache_total.evictions++;
+    }
+
+    entry->name = strdup(name);
+    if(entry->name == NULL){
+        free(frames);
+        return NULL;
+    }
+    entry->frames = frames;
+    entry->frame_count = frame_count;
+    entry->width = width;
+    entry->height = height;
+    entry->bytes = bytes;
+    entry->last_used = ++use_count;
+    pattern_cache_total.bytes += bytes;
+    pattern_cache_total.entries++;
+    return entry;
+}
+
+/* The active pattern is pinned, the rest are trimmed to the budget */
+void pattern_cache_set_active(pattern_entry *entry){
+    active = entry;
+    evict();
+}
+
+void pattern_cache_set_budget(size_t bytes){
+    budget = bytes;
+    evict();
+}
+
+/* Frees everything, including the pattern on show */
+void pattern_cache_clear(){
+    int x;
+    for(x = 0; x < PATTERN_CACHE_MAX; x++){
+        if(entries[x].name != NULL) free_entry(&entries[x]);
+    }
+    active = NULL;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+    Patterns already decoded and encoded into LED frames, kept by file
+    name so switching back to one skips the SD card and the PNG decoder.
+    Least recently used patterns are freed once the total goes over the
+    byte budget, the one on show is never freed.
+*/
+
+#define PATTERN_CACHE_MAX 32
+#define PATTERN_CACHE_DEFAULT_BUDGET (256 * 1024)
+
+typedef struct pattern_entry {
+    char *name;
+    char *frames;               // PIXEL_DATA_SIZE bytes per frame
+    int frame_count;
+    int width, height;
+    size_t bytes;
+    unsigned long last_used;
+} pattern_entry;
+
+typedef struct pattern_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    int entries;
+} pattern_cache_stats;
+
+pattern_cache_stats pattern_cache_total;
+
+pattern_entry *pattern_cache_find(const char *name);
+pattern_entry *pattern_cache_insert(const char *name, char *frames, int frame_count, int width, int height, size_t bytes);
+void pattern_cache_set_active(pattern_entry *entry);
+void pattern_cache_set_budget(size_t bytes);
+void pattern_cache_clear();
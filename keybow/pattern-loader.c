@@ -0,0 +1,160 @@
+#include "pattern-loader.h"
+#include "keybow.h"
+#include "key-ring.h"
+#include "lights.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct pattern_load_request {
+    int id;
+    char *file_name;
+    int ok;
+} pattern_load_request;
+
+static pthread_t t_loader;
+static pthread_mutex_t loader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loader_cond = PTHREAD_COND_INITIALIZER;
+static int loader_started = 0;
+static int loader_running = 0;
+
+static pattern_load_request queued[PATTERN_LOAD_QUEUE];
+static int queued_count = 0;
+static pattern_load_request done[PATTERN_LOAD_QUEUE];
+static int done_count = 0;
+static int outstanding = 0;     // Queued, loading or done but not yet taken
+static int next_id = 1;
+
+/* Decodes outside lights_mutex, only the cache update and swap happen under it */
+static int load(const char *file_name){
+    pthread_mutex_lock(&lights_mutex);
+    pattern_entry *entry = pattern_cache_find(file_name);
+    if(entry) lights_showPattern(entry);
+    pthread_mutex_unlock(&lights_mutex);
+    if(entry) return 1;
+
+    int frame_count, width, height;
+    char *encoded = lights_encodePng(file_name, &frame_count, &width, &height);
+    if(encoded == NULL) return 0;
+
+    pthread_mutex_lock(&lights_mutex);
+    entry = pattern_cache_insert(file_name, encoded, frame_count, width, height,
+        frame_count * PIXEL_DATA_SIZE);
+    if(entry) lights_showPattern(entry);
+    pthread_mutex_unlock(&lights_mutex);
+    return entry != NULL;
+}
+
+/* Called with loader_mutex held */
+static void finish(pattern_load_request *request){
+    free(request->file_name);
+    request->file_name = NULL;
+    done[done_count++] = *request;
+    key_ring_notify(&key_events);
+}
+
+static void *run_loader(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_mutex_lock(&loader_mutex);
+    while(loader_running){
+        if(queued_count == 0){
+            pthread_cond_wait(&loader_cond, &loader_mutex);
+            continue;
+        }
+        pattern_load_request request = queued[0];
+        queued_count--;
+        memmove(queued, queued + 1, sizeof(pattern_load_request) * queued_count);
+        pthread_mutex_unlock(&loader_mutex);
+
+        request.ok = load(request.file_name);
+
+        pthread_mutex_lock(&loader_mutex);
+        finish(&request);
+    }
+    pthread_mutex_unlock(&loader_mutex);
+    return NULL;
+}
+
+/*
+    Queues a pattern to load, returns an id to match it up with
+    pattern_load_take(), or -1 if too many loads are outstanding.
+    Trace replays load there and then, so they stay repeatable.
+*/
+int pattern_load(const char *file_name){
+    pthread_mutex_lock(&loader_mutex);
+    if(outstanding == PATTERN_LOAD_QUEUE){
+        pthread_mutex_unlock(&loader_mutex);
+        return -1;
+    }
+    pattern_load_request request = {.id = next_id++, .file_name = strdup(file_name)};
+    if(request.file_name == NULL){
+        pthread_mutex_unlock(&loader_mutex);
+        return -1;
+    }
+    outstanding++;
+
+    if(clock_simulated){
+        pthread_mutex_unlock(&loader_mutex);
+        request.ok = load(request.file_name);
+        pthread_mutex_lock(&loader_mutex);
+        finish(&request);
+        pthread_mutex_unlock(&loader_mutex);
+        return request.id;
+    }
+
+    if(!loader_started){
+        loader_running = 1;
+        if(pthread_create(&t_loader, NULL, run_loader, NULL)){
+            printf("Error creating pattern loader thread.\n");
+            loader_running = 0;
+            outstanding--;
+            free(request.file_name);
+            pthread_mutex_unlock(&loader_mutex);
+            return -1;
+        }
+        loader_started = 1;
+    }
+    queued[queued_count++] = request;
+    pthread_cond_signal(&loader_cond);
+    pthread_mutex_unlock(&loader_mutex);
+    return request.id;
+}
+
+/* Lua thread side. Returns 1, with the id and whether it loaded, per finished load */
+int pattern_load_take(int *id, int *ok){
+    pthread_mutex_lock(&loader_mutex);
+    if(done_count == 0){
+        pthread_mutex_unlock(&loader_mutex);
+        return 0;
+    }
+    *id = done[0].id;
+    *ok = done[0].ok;
+    done_count--;
+    memmove(done, done + 1, sizeof(pattern_load_request) * done_count);
+    outstanding--;
+    pthread_mutex_unlock(&loader_mutex);
+    return 1;
+}
+
+/* Waits for the load in progress, anything still queued is dropped */
+void pattern_loader_stop(){
+    int x;
+    if(!loader_started) return;
+    pthread_mutex_lock(&loader_mutex);
+    loader_running = 0;
+    pthread_cond_signal(&loader_cond);
+    pthread_mutex_unlock(&loader_mutex);
+    pthread_join(t_loader, NULL);
+    loader_started = 0;
+
+    for(x = 0; x < queued_count; x++){
+        free(queued[x].file_name);
+    }
+    queued_count = 0;
+    done_count = 0;
+    outstanding = 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+/*
+    Loads patterns on a worker thread. The PNG is decoded without
+    holding lights_mutex, the old pattern keeps playing, and the new
+    one replaces it in one step once it's ready. Finished loads are
+    handed back to the Lua thread, waking it through the key ring.
+*/
+
+#define PATTERN_LOAD_QUEUE 8    // Loads queued or finished but not yet taken
+
+int pattern_load(const char *file_name);
+int pattern_load_take(int *id, int *ok);
+void pattern_loader_stop();
@@ -0,0 +1,465 @@
+#include "sequencer.h"
+#include "lights.h"
+#include "midi-in.h"
+#include "midi-out.h"
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+/*
+    Every step has an absolute deadline worked out from where the voice
+    started, rather than from when the previous step happened to fire,
+    so lateness never builds up from one step to the next.
+*/
+typedef struct seq_voice {
+    int playing;
+    int port;
+    unsigned char channel;
+    unsigned char division;
+    unsigned char swing;            // Percentage of a pair of steps the first one gets, 50 is straight
+    unsigned long step;             // Steps since start
+    double origin_us;               // When step 0 would have started at the current tempo
+    unsigned long long next_us;     // Deadline of the next step
+    unsigned long long off_us;      // Deadline of the sounding note's note off, 0 when silent
+    unsigned char sounding;
+} seq_voice;
+
+typedef struct seq_pattern {
+    seq_voice voice;
+    seq_step steps[SEQ_MAX_STEPS];
+    unsigned int length;
+} seq_pattern;
+
+typedef struct seq_arp {
+    seq_voice voice;
+    unsigned char mode;
+    unsigned char octaves;
+    unsigned char gate;
+    unsigned char notes[SEQ_MAX_HELD];      // In the order they were pressed
+    unsigned char velocities[SEQ_MAX_HELD];
+    int held;
+    unsigned long position;
+} seq_arp;
+
+static pthread_t t_sequencer;
+static pthread_mutex_t seq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static seq_stats stats_total;
+static int seq_started = 0;
+static int seq_running = 0;
+static int timer_fd = -1;
+static int wake_fd = -1;
+
+static double bpm = SEQ_DEFAULT_BPM;
+static seq_pattern patterns[SEQ_MAX_PATTERNS];
+static seq_arp arp = {
+    .voice = {.division = SEQ_DEFAULT_DIVISION, .swing = 50},
+    .octaves = 1,
+    .gate = 50
+};
+
+static double step_us(seq_voice *voice){
+    return 60000000.0 / (bpm * voice->division);
+}
+
+/* Swing pushes every second step later, towards the one after it */
+static unsigned long long step_time(seq_voice *voice, unsigned long step){
+    double length = step_us(voice);
+    double t = voice->origin_us + step * length;
+    if(step & 1){
+        t += 2 * length * (voice->swing - 50) / 100.0;
+    }
+    return (unsigned long long)t;
+}
+
+static void voice_start(seq_voice *voice, unsigned long long now){
+    voice->playing = 1;
+    voice->step = 0;
+    voice->origin_us = now;
+    voice->next_us = now;
+}
+
+static void note_off(seq_voice *voice){
+    if(!voice->off_us) return;
+    midi_out_message(voice->port, MIDI_NOTE_OFF | voice->channel, voice->sounding, 0);
+    voice->off_us = 0;
+}
+
+static void note_on(seq_voice *voice, unsigned char note, unsigned char velocity, unsigned char gate){
+    note_off(voice);
+    if(velocity == 0) return;
+    midi_out_message(voice->port, MIDI_NOTE_ON | voice->channel, note, velocity);
+    voice->sounding = note;
+    // Schedule against the deadline rather than now, a late step doesn't lengthen the note
+    voice->off_us = voice->next_us + (unsigned long long)(step_us(voice) * gate / 100);
+    if(voice->off_us == 0) voice->off_us = 1;
+}
+
+static void record(unsigned long long deadline, unsigned long long now){
+    unsigned long long late = now > deadline ? now - deadline : 0;
+    stats_total.events++;
+    stats_total.total_us += late;
+    if(late > stats_total.max_us) stats_total.max_us = late;
+    if(late > SEQ_LATE_US) stats_total.late++;
+}
+
+static int compare_notes(const void *a, const void *b){
+    return *(const unsigned char *)a - *(const unsigned char *)b;
+}
+
+/* Picks the next note for the arpeggiator, spread over its octaves */
+static int arp_next(unsigned char *note, unsigned char *velocity){
+    unsigned char sorted[SEQ_MAX_HELD];
+    int count = arp.held;
+    int length = count * arp.octaves;
+    int index;
+    if(count == 0) return 0;
+
+    memcpy(sorted, arp.notes, count);
+    if(arp.mode != ARP_ORDER){
+        qsort(sorted, count, 1, compare_notes);
+    }
+
+    switch(arp.mode){
+        case ARP_DOWN:
+            index = length - 1 - arp.position % length;
+            break;
+        case ARP_UP_DOWN:
+            // Up then back down without playing the top and bottom notes twice
+            index = length > 1 ? arp.position % (2 * length - 2) : 0;
+            if(index >= length) index = 2 * length - 2 - index;
+            break;
+        case ARP_RANDOM:
+            index = rand() % length;
+            break;
+        default:
+            index = arp.position % length;
+    }
+    arp.position++;
+
+    int x;
+    *note = sorted[index % count] + 12 * (index / count);
+    *velocity = arp.velocities[0];
+    for(x = 0; x < count; x++){
+        if(arp.notes[x] == sorted[index % count]) *velocity = arp.velocities[x];
+    }
+    if(*note > 127) *note = 127;
+    return 1;
+}
+
+static void step_pattern(seq_pattern *pattern){
+    seq_step *step = &pattern->steps[pattern->voice.step % pattern->length];
+    note_on(&pattern->voice, step->note, step->velocity, step->gate);
+}
+
+static void step_arp(){
+    unsigned char note, velocity;
+    if(arp_next(&note, &velocity)){
+        note_on(&arp.voice, note, velocity, arp.gate);
+    }
+}
+
+/*
+    Called with seq_mutex held, fires whatever is due for a pattern, or
+    the arpeggiator when pattern is NULL. Returns 1 if anything was sent.
+*/
+static int process_voice(seq_voice *voice, seq_pattern *pattern, unsigned long long now){
+    int sent = 0;
+    if(voice->off_us && voice->off_us <= now){
+        record(voice->off_us, now);
+        note_off(voice);
+        sent = 1;
+    }
+    if(voice->playing && voice->next_us <= now){
+        record(voice->next_us, now);
+        if(pattern) step_pattern(pattern);
+        else step_arp();
+        sent = 1;
+        // Fallen a whole step behind, skip rather than play a burst of catch up notes
+        do {
+            voice->step++;
+            voice->next_us = step_time(voice, voice->step);
+        } while(voice->next_us <= now);
+    }
+    return sent;
+}
+
+static unsigned long long earliest(unsigned long long next, unsigned long long t){
+    if(t && (next == 0 || t < next)) return t;
+    return next;
+}
+
+static unsigned long long process(unsigned long long now, int *sent){
+    unsigned long long next = 0;
+    int x;
+    for(x = 0; x < SEQ_MAX_PATTERNS; x++){
+        seq_voice *voice = &patterns[x].voice;
+        *sent |= process_voice(voice, &patterns[x], now);
+        next = earliest(next, voice->off_us);
+        if(voice->playing) next = earliest(next, voice->next_us);
+    }
+    *sent |= process_voice(&arp.voice, NULL, now);
+    next = earliest(next, arp.voice.off_us);
+    if(arp.voice.playing) next = earliest(next, arp.voice.next_us);
+    return next;
+}
+
+/* 0 disarms the timer, a deadline already gone fires it straight away */
+static void arm(unsigned long long deadline){
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000;
+    its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void *run_sequencer(void *void_ptr){
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct pollfd fds[2] = {
+        {.fd = timer_fd, .events = POLLIN},
+        {.fd = wake_fd, .events = POLLIN}
+    };
+    uint64_t count;
+
+    pthread_mutex_lock(&seq_mutex);
+    while(seq_running){
+        int sent = 0;
+        unsigned long long next = process(micros(), &sent);
+        pthread_mutex_unlock(&seq_mutex);
+
+        if(sent) midi_out_flush();
+        arm(next);
+        if(poll(fds, 2, -1) > 0){
+            if(fds[0].revents & POLLIN) read(timer_fd, &count, sizeof(count));
+            if(fds[1].revents & POLLIN) read(wake_fd, &count, sizeof(count));
+        }
+
+        pthread_mutex_lock(&seq_mutex);
+    }
+    pthread_mutex_unlock(&seq_mutex);
+    return NULL;
+}
+
+/*
+    Called with seq_mutex held. The thread starts on first use, trace
+    replays run on a simulated clock that a timerfd can't follow, so
+    they don't get one and nothing is played.
+*/
+static int wake(){
+    uint64_t one = 1;
+    if(clock_simulated) return 1;
+    if(!seq_started){
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        wake_fd = eventfd(0, EFD_NONBLOCK);
+        if(timer_fd == -1 || wake_fd == -1){
+            printf("Error creating sequencer timer.\n");
+            if(timer_fd != -1) close(timer_fd);
+            if(wake_fd != -1) close(wake_fd);
+            timer_fd = wake_fd = -1;
+            return 1;
+        }
+        seq_running = 1;
+        if(pthread_create(&t_sequencer, NULL, run_sequencer, NULL)){
+            printf("Error creating sequencer thread.\n");
+            seq_running = 0;
+            close(timer_fd);
+            close(wake_fd);
+            timer_fd = wake_fd = -1;
+            return 1;
+        }
+        seq_started = 1;
+    }
+    write(wake_fd, &one, sizeof(one));
+    return 0;
+}
+
+/* Called with seq_mutex held, keeps playing voices on the step they're at */
+static void retime(seq_voice *voice, double new_bpm){
+    double old_length = step_us(voice);
+    double new_length = 60000000.0 / (new_bpm * voice->division);
+    voice->origin_us += voice->step * (old_length - new_length);
+}
+
+void seq_set_tempo(double new_bpm){
+    int x;
+    if(new_bpm < 1) new_bpm = 1;
+    if(new_bpm > 999) new_bpm = 999;
+    pthread_mutex_lock(&seq_mutex);
+    for(x = 0; x < SEQ_MAX_PATTERNS; x++){
+        retime(&patterns[x].voice, new_bpm);
+    }
+    retime(&arp.voice, new_bpm);
+    bpm = new_bpm;
+    for(x = 0; x < SEQ_MAX_PATTERNS; x++){
+        if(patterns[x].voice.playing){
+            patterns[x].voice.next_us = step_time(&patterns[x].voice, patterns[x].voice.step);
+        }
+    }
+    if(arp.voice.playing){
+        arp.voice.next_us = step_time(&arp.voice, arp.voice.step);
+    }
+    if(seq_started) wake();
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/* Replacing a playing pattern carries on from the same step */
+int seq_set_pattern(int id, const seq_step *steps, unsigned int length,
+        int port, unsigned char channel, unsigned char division, unsigned char swing){
+    if(id < 0 || id >= SEQ_MAX_PATTERNS || length == 0 || length > SEQ_MAX_STEPS) return 1;
+    if(division == 0) division = SEQ_DEFAULT_DIVISION;
+    if(swing < 50) swing = 50;
+    if(swing > 75) swing = 75;
+
+    pthread_mutex_lock(&seq_mutex);
+    seq_pattern *pattern = &patterns[id];
+    if(pattern->voice.playing && pattern->voice.division != division){
+        retime(&pattern->voice, bpm * division / pattern->voice.division);
+    }
+    memcpy(pattern->steps, steps, sizeof(seq_step) * length);
+    pattern->length = length;
+    // The sounding note's note off has to go where its note on went
+    if(pattern->voice.port != port || pattern->voice.channel != (channel & 0x0f)){
+        note_off(&pattern->voice);
+    }
+    pattern->voice.port = port;
+    pattern->voice.channel = channel & 0x0f;
+    pattern->voice.division = division;
+    pattern->voice.swing = swing;
+    if(pattern->voice.playing){
+        pattern->voice.next_us = step_time(&pattern->voice, pattern->voice.step);
+        wake();
+    }
+    pthread_mutex_unlock(&seq_mutex);
+    return 0;
+}
+
+int seq_play(int id){
+    if(id < 0 || id >= SEQ_MAX_PATTERNS) return 1;
+    pthread_mutex_lock(&seq_mutex);
+    int ret = 1;
+    if(patterns[id].length){
+        voice_start(&patterns[id].voice, micros());
+        ret = wake();
+    }
+    pthread_mutex_unlock(&seq_mutex);
+    return ret;
+}
+
+/* The sounding note still gets its note off on time */
+void seq_stop_pattern(int id){
+    if(id < 0 || id >= SEQ_MAX_PATTERNS) return;
+    pthread_mutex_lock(&seq_mutex);
+    patterns[id].voice.playing = 0;
+    if(seq_started) wake();
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/* Timing of every event so far, copied under the lock so the sums agree */
+void seq_get_stats(seq_stats *stats){
+    pthread_mutex_lock(&seq_mutex);
+    *stats = stats_total;
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/* Step last played, or -1 if the pattern isn't playing */
+int seq_position(int id){
+    if(id < 0 || id >= SEQ_MAX_PATTERNS) return -1;
+    pthread_mutex_lock(&seq_mutex);
+    seq_pattern *pattern = &patterns[id];
+    int ret = -1;
+    if(pattern->voice.playing && pattern->voice.step > 0){
+        ret = (pattern->voice.step - 1) % pattern->length;
+    }
+    pthread_mutex_unlock(&seq_mutex);
+    return ret;
+}
+
+void arp_configure(unsigned char mode, int port, unsigned char channel, unsigned char division,
+        unsigned char octaves, unsigned char gate){
+    pthread_mutex_lock(&seq_mutex);
+    if(division == 0) division = SEQ_DEFAULT_DIVISION;
+    if(arp.voice.playing && arp.voice.division != division){
+        retime(&arp.voice, bpm * division / arp.voice.division);
+    }
+    arp.mode = mode > ARP_RANDOM ? ARP_UP : mode;
+    if(arp.voice.port != port || arp.voice.channel != (channel & 0x0f)){
+        note_off(&arp.voice);
+    }
+    arp.voice.port = port;
+    arp.voice.channel = channel & 0x0f;
+    arp.voice.division = division;
+    arp.octaves = octaves < 1 ? 1 : (octaves > 4 ? 4 : octaves);
+    arp.gate = gate < 1 ? 1 : (gate > 100 ? 100 : gate);
+    if(arp.voice.playing){
+        arp.voice.next_us = step_time(&arp.voice, arp.voice.step);
+        wake();
+    }
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/*
+    Adds a held note to the arpeggiator, or takes it away with a
+    velocity of 0. The first note starts it, the last one stops it.
+*/
+void arp_note(unsigned char note, unsigned char velocity){
+    int x;
+    pthread_mutex_lock(&seq_mutex);
+    for(x = 0; x < arp.held; x++){
+        if(arp.notes[x] == note) break;
+    }
+    if(velocity){
+        if(x == arp.held && arp.held < SEQ_MAX_HELD){
+            arp.notes[arp.held] = note;
+            arp.velocities[arp.held] = velocity;
+            arp.held++;
+        }
+        if(!arp.voice.playing){
+            arp.position = 0;
+            voice_start(&arp.voice, micros());
+            wake();
+        }
+    }
+    else if(x < arp.held){
+        arp.held--;
+        memmove(arp.notes + x, arp.notes + x + 1, arp.held - x);
+        memmove(arp.velocities + x, arp.velocities + x + 1, arp.held - x);
+        if(arp.held == 0){
+            arp.voice.playing = 0;
+            if(seq_started) wake();
+        }
+    }
+    pthread_mutex_unlock(&seq_mutex);
+}
+
+/* Stops the thread and silences anything still sounding */
+void seq_stop(){
+    int x;
+    if(!seq_started) return;
+    pthread_mutex_lock(&seq_mutex);
+    seq_running = 0;
+    wake();
+    pthread_mutex_unlock(&seq_mutex);
+    pthread_join(t_sequencer, NULL);
+    close(timer_fd);
+    close(wake_fd);
+    timer_fd = wake_fd = -1;
+    seq_started = 0;
+
+    for(x = 0; x < SEQ_MAX_PATTERNS; x++){
+        patterns[x].voice.playing = 0;
+        note_off(&patterns[x].voice);
+    }
+    arp.voice.playing = 0;
+    arp.held = 0;
+    note_off(&arp.voice);
+    midi_out_flush();
+}
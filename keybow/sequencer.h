@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+    Step sequencer and arpeggiator. Patterns are handed over once from
+    Lua and played by their own thread, sleeping on a timerfd until the
+    next absolute deadline so notes land on the grid however busy the
+    main loop is. Notes go out through midi_out.
+*/
+
+#define SEQ_MAX_PATTERNS 8
+#define SEQ_MAX_STEPS 64
+#define SEQ_MAX_HELD 16              // Notes the arpeggiator keeps track of
+#define SEQ_DEFAULT_BPM 120
+#define SEQ_DEFAULT_DIVISION 4       // Steps per beat, sixteenths
+#define SEQ_LATE_US 1000             // Events later than this count as late
+
+#define ARP_UP      0
+#define ARP_DOWN    1
+#define ARP_UP_DOWN 2
+#define ARP_ORDER   3                // The order the notes were pressed in
+#define ARP_RANDOM  4
+
+typedef struct seq_step {
+    unsigned char note;
+    unsigned char velocity;          // 0 is a rest
+    unsigned char gate;              // Percentage of the step the note sounds for
+} seq_step;
+
+typedef struct seq_stats {
+    unsigned long events;
+    unsigned long late;
+    unsigned long long total_us;     // Summed lateness, for the average
+    unsigned long long max_us;
+} seq_stats;
+
+void seq_set_tempo(double bpm);
+int seq_set_pattern(int id, const seq_step *steps, unsigned int length,
+    int port, unsigned char channel, unsigned char division, unsigned char swing);
+int seq_play(int id);
+void seq_stop_pattern(int id);
+int seq_position(int id);
+void seq_get_stats(seq_stats *stats);
+void arp_configure(unsigned char mode, int port, unsigned char channel, unsigned char division,
+    unsigned char octaves, unsigned char gate);
+void arp_note(unsigned char note, unsigned char velocity);
+void seq_stop();
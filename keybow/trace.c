@@ -0,0 +1,57 @@
+#include "trace.h"
+#include <string.h>
+
+static FILE *trace_fp = NULL;
+static unsigned long long trace_last_us = 0;
+
+int trace_start(const char *file_name){
+    trace_stop();
+    trace_fp = fopen(file_name, "wb");
+    if(trace_fp == NULL){
+        printf("Error opening %s for writing\n", file_name);
+        return 1;
+    }
+    fwrite(TRACE_MAGIC, 1, 4, trace_fp);
+    fputc(TRACE_VERSION, trace_fp);
+    trace_last_us = 0;
+    return 0;
+}
+
+void trace_write(const key_event *event){
+    if(trace_fp == NULL) return;
+
+    unsigned long long delta = trace_last_us ? event->timestamp - trace_last_us : 0;
+    trace_record record = {
+        .delta_us = delta > UINT32_MAX ? UINT32_MAX : delta,
+        .key_index = event->key_index,
+        .state = event->state
+    };
+    trace_last_us = event->timestamp;
+    fwrite(&record, sizeof(record), 1, trace_fp);
+}
+
+void trace_stop(){
+    if(trace_fp == NULL) return;
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+FILE *trace_open(const char *file_name){
+    char header[5];
+    FILE *fp = fopen(file_name, "rb");
+    if(fp == NULL){
+        printf("Error opening %s for reading\n", file_name);
+        return NULL;
+    }
+    if(fread(header, 1, 5, fp) != 5 || memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION){
+        printf("%s is not a key trace\n", file_name);
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/* Returns 0 at the end of the trace */
+int trace_read(FILE *fp, trace_record *record){
+    return fread(record, sizeof(trace_record), 1, fp) == 1;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "key-ring.h"
+
+/*
+    Key event traces.
+
+    A trace is the 4 byte magic "KBTR", a version byte and then one
+    6 byte record per debounced transition, all little endian.
+    Timestamps are stored as microseconds since the previous record.
+*/
+
+#define TRACE_MAGIC   "KBTR"
+#define TRACE_VERSION 1
+
+typedef struct __attribute__((packed)) trace_record {
+    uint32_t delta_us;
+    uint8_t key_index;
+    uint8_t state;
+} trace_record;
+
+int trace_start(const char *file_name);
+void trace_write(const key_event *event);
+void trace_stop();
+
+FILE *trace_open(const char *file_name);
+int trace_read(FILE *fp, trace_record *record);
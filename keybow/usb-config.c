@@ -0,0 +1,118 @@
+#include "usb-config.h"
+#include "gadget-hid.h"
+#include "hid-writer.h"
+#include "midi-out.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef KEYBOW_NO_USB_HID
+#include <libconfig.h>
+#endif
+
+void usb_config_defaults(){
+    usb_settings.hid_profile = HID_PROFILE_DEFAULT;
+    usb_settings.hid_interval_us = HID_REPORT_INTERVAL_US;
+    usb_settings.hid_report_length = HID_NKRO_REPORT_SIZE;
+    usb_settings.midi_ports = 1;
+    usb_settings.midi_buflen = MIDI_DEFAULT_BUFLEN;
+    usb_settings.midi_qlen = MIDI_DEFAULT_QLEN;
+}
+
+/* Out of range values are clamped rather than refused, so the keyboard always comes up */
+static void check_limits(){
+    if(usb_settings.hid_interval_us < 125){
+        usb_settings.hid_interval_us = 125;
+    }
+    if(usb_settings.hid_report_length < HID_REPORT_SIZE){
+        usb_settings.hid_report_length = HID_REPORT_SIZE;
+    }
+    if(usb_settings.hid_report_length > HID_WRITER_MAX_REPORT){
+        usb_settings.hid_report_length = HID_WRITER_MAX_REPORT;
+    }
+    if(usb_settings.midi_ports < 1){
+        usb_settings.midi_ports = 1;
+    }
+    if(usb_settings.midi_ports > MIDI_MAX_PORTS){
+        usb_settings.midi_ports = MIDI_MAX_PORTS;
+    }
+    if(usb_settings.midi_buflen < 64){
+        usb_settings.midi_buflen = 64;
+    }
+    if(usb_settings.midi_buflen > 4096){
+        usb_settings.midi_buflen = 4096;
+    }
+    if(usb_settings.midi_qlen < 1){
+        usb_settings.midi_qlen = 1;
+    }
+    if(usb_settings.midi_qlen > 256){
+        usb_settings.midi_qlen = 256;
+    }
+}
+
+#ifndef KEYBOW_NO_USB_HID
+static void set_profile(const char *profile){
+    if(strcmp(profile, "gaming") == 0){
+        usb_settings.hid_profile = HID_PROFILE_GAMING;
+        usb_settings.hid_interval_us = HID_GAMING_INTERVAL_US;
+    }
+    else if(strcmp(profile, "standard") == 0){
+        usb_settings.hid_profile = HID_PROFILE_STANDARD;
+        usb_settings.hid_interval_us = HID_STANDARD_INTERVAL_US;
+    }
+    else {
+        printf("Error: unknown HID profile %s\n", profile);
+    }
+}
+
+int usb_config_load(const char *path){
+    config_t cfg;
+    const char *profile;
+    int value;
+
+    usb_config_defaults();
+    if(access(path, R_OK) != 0){
+        return 0;
+    }
+
+    config_init(&cfg);
+    if(config_read_file(&cfg, path) != CONFIG_TRUE){
+        printf("Error reading %s:%d - %s\n", path, config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return 1;
+    }
+
+    if(config_lookup_string(&cfg, "hid.profile", &profile) == CONFIG_TRUE){
+        set_profile(profile);
+    }
+    if(config_lookup_int(&cfg, "hid.interval_us", &value) == CONFIG_TRUE && value > 0){
+        usb_settings.hid_interval_us = value;
+    }
+    if(config_lookup_int(&cfg, "hid.report_length", &value) == CONFIG_TRUE && value > 0){
+        usb_settings.hid_report_length = value;
+    }
+    if(config_lookup_int(&cfg, "midi.ports", &value) == CONFIG_TRUE && value > 0){
+        usb_settings.midi_ports = value;
+    }
+    if(config_lookup_int(&cfg, "midi.buflen", &value) == CONFIG_TRUE && value > 0){
+        usb_settings.midi_buflen = value;
+    }
+    if(config_lookup_int(&cfg, "midi.qlen", &value) == CONFIG_TRUE && value > 0){
+        usb_settings.midi_qlen = value;
+    }
+    config_destroy(&cfg);
+
+    check_limits();
+#ifdef KEYBOW_DEBUG
+    printf("HID interval %dus, report length %d\n", usb_settings.hid_interval_us, usb_settings.hid_report_length);
+    printf("MIDI ports %d, buflen %d, qlen %d\n", usb_settings.midi_ports, usb_settings.midi_buflen, usb_settings.midi_qlen);
+#endif
+    return 0;
+}
+#else
+/* libconfig is only linked into the USB builds */
+int usb_config_load(const char *path){
+    usb_config_defaults();
+    check_limits();
+    return 0;
+}
+#endif
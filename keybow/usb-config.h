@@ -0,0 +1,45 @@
+#pragma once
+
+/*
+    USB gadget settings, read from KEYBOW_USB_CONFIG in KEYBOW_HOME
+    before the gadget is created. A missing file keeps the defaults.
+
+        hid = {
+            profile = "gaming";     # "standard" (8ms) or "gaming" (1ms)
+            interval_us = 1000;     # Overrides the profile
+            report_length = 34;     # 16 is enough without N-key rollover
+        };
+        midi = {
+            ports = 2;              # Virtual cables, up to 4
+            buflen = 256;           # Bytes per USB request
+            qlen = 32;              # Requests queued, raise if bursts see queue_full
+        };
+*/
+
+#ifndef KEYBOW_USB_CONFIG
+#define KEYBOW_USB_CONFIG "keybow.cfg"
+#endif
+
+#define HID_PROFILE_DEFAULT  0
+#define HID_PROFILE_STANDARD 1 // 125Hz, like most keyboards
+#define HID_PROFILE_GAMING   2 // 1000Hz, the fastest a full/high speed interrupt endpoint is usually polled
+
+#define HID_STANDARD_INTERVAL_US 8000
+#define HID_GAMING_INTERVAL_US   1000
+
+#define MIDI_DEFAULT_BUFLEN 128
+#define MIDI_DEFAULT_QLEN   16
+
+typedef struct usb_config {
+    int hid_profile;
+    unsigned int hid_interval_us;   // Endpoint polling interval, also paces the HID writer
+    unsigned int hid_report_length; // Largest report the HID function accepts
+    unsigned int midi_ports;        // In and out ports on the MIDI function
+    unsigned int midi_buflen;
+    unsigned int midi_qlen;
+} usb_config;
+
+usb_config usb_settings;
+
+void usb_config_defaults();
+int usb_config_load(const char *path);
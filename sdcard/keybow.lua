@@ -1,8 +1,5 @@
 keybow = {}
 
-local KEYCODES         = "abcdefghijklmnopqrstuvwxyz1234567890\n\a\b\t -=[]\\#;'`,./"
-local SHIFTED_KEYCODES = "ABCDEFGHIJKLMNOPQRSTUVWXYZ!@#$%^&*()\a\a\a\a\a_+{}|~:\"~<>?"
-
 keybow.LEFT_CTRL = 0
 keybow.LEFT_SHIFT = 1
 keybow.LEFT_ALT = 2
@@ -57,6 +54,14 @@ keybow.MEDIA_MUTE = 5
 keybow.MEDIA_VOL_UP = 6
 keybow.MEDIA_VOL_DOWN = 7
 
+keybow.SCAN_POLL = 0
+keybow.SCAN_EDGE = 1
+
+keybow.DEBOUNCE_NONE = 0
+keybow.DEBOUNCE_EAGER = 1
+keybow.DEBOUNCE_DEFER = 2
+keybow.DEBOUNCE_ASYMMETRIC = 3
+
 -- Functions exposed from C
 
 function keybow.set_modifier(key, state)
@@ -75,13 +80,203 @@ function keybow.usleep(time)
     keybow_usleep(time)
 end
 
-function keybow.text(text)
-    for i = 1, #text do        
-        local c = text:sub(i, i)
-        keybow.tap_key(c)
+function keybow.set_scan_mode(mode)
+    keybow_set_scan_mode(mode)
+end
+
+-- Debouncing, times are in milliseconds
+-- release_time defaults to press_time
+
+function keybow.set_debounce(key, mode, press_time, release_time)
+    keybow_set_debounce(key, mode, press_time, release_time)
+end
+
+function keybow.set_debounce_all(mode, press_time, release_time)
+    for key = 0, 11 do
+        keybow_set_debounce(key, mode, press_time, release_time)
+    end
+end
+
+function keybow.get_debounce_rejects(key)
+    return keybow_get_debounce_rejects(key)
+end
+
+-- Key presses dropped because Lua fell too far behind the scanner
+
+function keybow.get_key_overflows()
+    return keybow_get_key_overflows()
+end
+
+-- Key-to-HID latency histograms
+-- (also written to latency.txt when keybow receives SIGUSR1)
+
+function keybow.latency_report()
+    return keybow_latency_report()
+end
+
+function keybow.send_latency_report()
+    keybow_serial_write(keybow_latency_report())
+end
+
+function keybow.latency_reset()
+    keybow_latency_reset()
+end
+
+-- Send at most one keyboard and one media report per batch of key
+-- handlers, built from the final state (taps still get both reports)
+
+function keybow.set_report_batching(enabled)
+    keybow_set_report_batching(enabled)
+end
+
+-- Report any number of held keys at once (N-key rollover)
+-- The default 13 key report also works with BIOSes and KVM switches
+
+function keybow.set_nkro(enabled)
+    keybow_set_nkro(enabled)
+end
+
+-- Macros are compiled once, then typed in the background by keybow
+-- while keys and tick() keep running. Steps are text, pauses in ms
+-- and chords:
+--
+-- local save = keybow.compile_macro{{key = "s", modifiers = {keybow.LEFT_CTRL}}, 100, "saved\n"}
+-- keybow.play_macro(save)
+
+function keybow.compile_macro(steps)
+    return keybow_compile_macro(steps)
+end
+
+function keybow.play_macro(macro)
+    return keybow_play_macro(macro)
+end
+
+function keybow.cancel_macro()
+    keybow_cancel_macro()
+end
+
+-- Returns playing, steps sent, total steps
+function keybow.macro_progress()
+    return keybow_macro_progress()
+end
+
+-- Returns false if the macro is playing and wasn't freed
+function keybow.free_macro(macro)
+    return keybow_free_macro(macro)
+end
+
+-- Like keybow.text(), but in the background and compiled on first use.
+-- When the macro slots run out the cached text is thrown away.
+
+local text_macros = {}
+
+local function free_text_macros()
+    for text, macro in pairs(text_macros) do
+        if keybow.free_macro(macro) then
+            text_macros[text] = nil
+        end
     end
+end
+
+function keybow.play_text(text)
+    if text_macros[text] == nil then
+        local macro = keybow.compile_macro({text})
+        if macro == nil then
+            free_text_macros()
+            macro = keybow.compile_macro({text})
+        end
+        if macro == nil then
+            return false
+        end
+        text_macros[text] = macro
+    end
+    return keybow.play_macro(text_macros[text])
+end
+
+-- Mouse keys
+-- Movement accelerates the longer a direction is held, from speed to
+-- max_speed pixels per second over accel_ms, wheel keys scroll at
+-- wheel_speed steps per second
+
+keybow.MOUSE_LEFT = 0
+keybow.MOUSE_RIGHT = 1
+keybow.MOUSE_MIDDLE = 2
+keybow.MOUSE_BACK = 3
+keybow.MOUSE_FORWARD = 4
+
+function keybow.mouse_button(button, pressed)
+    keybow_mouse_button(button, pressed)
+end
+
+-- eg: keybow.mouse_move_key(-1, 0, pressed) for a "left" key,
+-- x grows to the right and y downwards
+
+function keybow.mouse_move_key(dx, dy, pressed)
+    keybow_mouse_move_key(dx, dy, pressed)
+end
+
+-- eg: keybow.mouse_wheel_key(1, 0, pressed) to scroll up
+
+function keybow.mouse_wheel_key(dv, dh, pressed)
+    keybow_mouse_wheel_key(dv, dh, pressed)
+end
+
+function keybow.mouse_scroll(v, h)
+    keybow_mouse_scroll(v, h)
+end
 
-    keybow.set_modifier(keybow.LEFT_SHIFT, false)
+function keybow.mouse_set_acceleration(speed, max_speed, accel_ms, wheel_speed)
+    keybow_mouse_set_acceleration(speed, max_speed, accel_ms, wheel_speed)
+end
+
+-- Keyboard LEDs set by the host
+-- define handle_host_leds(num_lock, caps_lock, scroll_lock, compose, kana)
+-- to be told when they change
+
+keybow.NUM_LOCK = 0
+keybow.CAPS_LOCK = 1
+keybow.SCROLL_LOCK = 2
+keybow.COMPOSE = 3
+keybow.KANA = 4
+
+function keybow.get_host_leds()
+    return keybow_get_host_leds()
+end
+
+-- Light key x while the host LED is on, without any Lua involvement
+-- keybow.mirror_host_led(keybow.CAPS_LOCK, 3, 255, 0, 0)
+-- keybow.mirror_host_led(keybow.CAPS_LOCK) turns it off again
+
+function keybow.mirror_host_led(led, x, r, g, b)
+    keybow_mirror_host_led(led, x, r, g, b)
+end
+
+-- HID report counters: sent, retried (host busy), dropped,
+-- suppressed (identical to the last keyboard report, so never sent)
+
+function keybow.get_hid_stats()
+    return keybow_get_hid_stats()
+end
+
+function keybow.send_hid_stats()
+    local sent, retried, dropped, suppressed = keybow_get_hid_stats()
+    keybow_serial_write(string.format("HID sent: %d retried: %d dropped: %d suppressed: %d\n",
+        sent, retried, dropped, suppressed))
+end
+
+-- Record every key transition to a binary trace
+-- replay it with: keybow-test replay <trace> [hid capture] [midi capture]
+
+function keybow.trace_start(file)
+    return keybow_trace_start(file)
+end
+
+function keybow.trace_stop()
+    keybow_trace_stop()
+end
+
+function keybow.text(text)
+    keybow_text(text)
 end
 
 -- Lighting control
@@ -98,8 +293,49 @@ function keybow.clear_lights()
     keybow_clear_lights()
 end
 
-function keybow.load_pattern(file)
-    keybow_load_pattern(file)
+-- Patterns load in the background, the old one plays until the new one
+-- is ready. callback(ok) is called once it's on show, or failed to load.
+-- Returns false if too many loads are already waiting.
+
+local pattern_callbacks = {}
+
+function keybow.load_pattern(file, callback)
+    local id = keybow_load_pattern(file)
+    if id == nil then
+        return false
+    end
+    pattern_callbacks[id] = callback
+    return true
+end
+
+function keybow_pattern_loaded(id, ok)
+    local callback = pattern_callbacks[id]
+    pattern_callbacks[id] = nil
+    if callback then
+        callback(ok)
+    end
+end
+
+-- Loaded patterns are kept decoded, so switching back to one is instant.
+-- Patterns not used for longest are dropped once they take up more than
+-- bytes (256KB by default, a 400 frame pattern is about 19KB).
+
+function keybow.set_pattern_cache(bytes)
+    keybow_set_pattern_cache(bytes)
+end
+
+-- Pattern cache hits, misses, evictions, bytes used and patterns cached
+
+function keybow.get_pattern_cache_stats()
+    return keybow_get_pattern_cache_stats()
+end
+
+-- The LEDs are only written when something changes, plus a refresh every
+-- ms milliseconds (1000 by default) in case one picked up a glitch.
+-- keybow.lights_refresh(0) turns the refresh off.
+
+function keybow.lights_refresh(ms)
+    keybow_lights_refresh(ms)
 end
 
 -- Meta keys - ctrl, shift, alt and win/apple
@@ -152,12 +388,15 @@ function keybow.tap_function_key(index)
     keybow.set_key(index, false)
 end
 
+-- Characters are looked up in a table built into keybow (US layout)
+
 function keybow.ascii_to_shift(key)
     if not (type(key) == "string") then
         return false
     end
-    
-    return SHIFTED_KEYCODES.find(key) ~= nil
+
+    local _, shifted = keybow_ascii_to_hid(key)
+    return shifted == true
 end
 
 function keybow.ascii_to_hid(key)
@@ -165,35 +404,12 @@ function keybow.ascii_to_hid(key)
         return key
     end
 
-    key = key:lower()
-
-    code = KEYCODES:find(key)
-    
-    if code == nil then return nil end
-
-    return code + 3
+    -- Just the usage, shifted is what ascii_to_shift() is for
+    return (keybow_ascii_to_hid(key))
 end
 
 function keybow.set_key(key, pressed)
-    if type(key) == "string" then
-        local hid_code = nil
-        local shifted = SHIFTED_KEYCODES:find(key, 1, true) ~= nil
-
-        if shifted then
-            hid_code = SHIFTED_KEYCODES:find(key, 1, true)
-        else
-            hid_code = KEYCODES:find(key, 1, true)
-        end
-
-        if not (hid_code == nil) then
-            hid_code = hid_code + 3
-            if shifted then keybow.set_modifier(keybow.LEFT_SHIFT, pressed) end
-            keybow_set_key(hid_code, pressed)
-        end
-
-    else -- already a key code
-        keybow_set_key(key, pressed)
-    end
+    keybow_set_key(key, pressed)
 end
 
 function keybow.tap_enter()
@@ -231,8 +447,165 @@ end
 
 -- MIDI
 
-function keybow.send_midi_note(channel, note, velocity, pressed)
-    keybow_send_midi_note(channel, note, velocity, pressed)
+keybow.MIDI_NOTE_OFF = 0x80
+keybow.MIDI_NOTE_ON = 0x90
+keybow.MIDI_POLY_AFTERTOUCH = 0xa0
+keybow.MIDI_CONTROL_CHANGE = 0xb0
+keybow.MIDI_PROGRAM_CHANGE = 0xc0
+keybow.MIDI_CHANNEL_PRESSURE = 0xd0
+keybow.MIDI_PITCH_BEND = 0xe0
+keybow.MIDI_SONG_POSITION = 0xf2
+keybow.MIDI_SONG_SELECT = 0xf3
+keybow.MIDI_START = 0xfa
+keybow.MIDI_CONTINUE = 0xfb
+keybow.MIDI_STOP = 0xfc
+
+-- Every send takes an optional port last, 0 to 3 when keybow.cfg sets
+-- midi.ports, so groups of keys can play to different tracks.
+-- Ports that aren't there send on port 0.
+
+function keybow.send_midi_note(channel, note, velocity, pressed, port)
+    keybow_send_midi_note(channel, note, velocity, pressed, port)
+end
+
+function keybow.send_midi_cc(channel, controller, value, port)
+    keybow_send_midi_cc(channel, controller, value, port)
+end
+
+function keybow.send_midi_program(channel, program, port)
+    keybow_send_midi_program(channel, program, port)
+end
+
+-- bend runs from -8192 to 8191, 0 is centred
+
+function keybow.send_midi_pitch_bend(channel, bend, port)
+    keybow_send_midi_pitch_bend(channel, bend, port)
+end
+
+-- Channel pressure, or polyphonic aftertouch when a note is given
+
+function keybow.send_midi_aftertouch(channel, pressure, note, port)
+    keybow_send_midi_aftertouch(channel, pressure, note, port)
+end
+
+-- A string or table of bytes, F0 and F7 are added if missing
+
+function keybow.send_midi_sysex(data, port)
+    keybow_send_midi_sysex(data, port)
+end
+
+-- MIDI is written once per pass of the main loop (and before sleeping),
+-- keybow.midi_flush() sends whatever is buffered straight away
+
+function keybow.midi_flush()
+    keybow_midi_flush()
+end
+
+-- MIDI output counters: messages, writes, status bytes saved, bytes dropped
+-- and writes that found the USB queue full, for one port or all of them
+
+function keybow.get_midi_out_stats(port)
+    return keybow_get_midi_out_stats(port)
+end
+
+-- Step sequencer, up to 8 patterns (0 to 7) of up to 64 steps each, played
+-- in the background so timing doesn't depend on the main loop.
+-- Steps are note numbers, false for a rest, or {note=, velocity=, gate=}.
+-- options: port, channel, division (steps per beat, default 4), swing (50
+-- is straight, up to 75) and gate (percentage of a step a note lasts, 50).
+-- Setting a pattern that is playing changes it from the next step.
+
+function keybow.seq_pattern(id, steps, options)
+    options = options or {}
+    return keybow_seq_set_pattern(id, steps, options.channel, options.division, options.swing, options.gate, options.port)
+end
+
+function keybow.seq_play(id)
+    return keybow_seq_play(id)
+end
+
+function keybow.seq_stop(id)
+    keybow_seq_stop(id)
+end
+
+-- Step a pattern is on, or -1 if it's stopped
+
+function keybow.seq_position(id)
+    return keybow_seq_position(id)
+end
+
+-- Tempo for patterns and the arpeggiator, default 120bpm
+
+function keybow.seq_tempo(bpm)
+    keybow_seq_tempo(bpm)
+end
+
+-- Arpeggiator, plays the notes held with keybow.arp_note() in turn.
+-- options: mode, port, channel, division, octaves (1 to 4) and gate.
+
+keybow.ARP_UP = 0
+keybow.ARP_DOWN = 1
+keybow.ARP_UP_DOWN = 2
+keybow.ARP_ORDER = 3
+keybow.ARP_RANDOM = 4
+
+function keybow.arp_configure(options)
+    options = options or {}
+    keybow_arp_configure(options.mode, options.channel, options.division, options.octaves, options.gate, options.port)
+end
+
+-- Call from handle_key, the first held note starts the arpeggiator and
+-- releasing the last stops it
+
+function keybow.arp_note(note, pressed, velocity)
+    if pressed then
+        keybow_arp_note(note, velocity or 100)
+    else
+        keybow_arp_note(note, 0)
+    end
+end
+
+-- Sequencer timing: events played, average and worst lateness in
+-- microseconds, and how many were more than a millisecond late
+
+function keybow.get_seq_stats()
+    return keybow_get_seq_stats()
+end
+
+-- MIDI from the host is passed to whichever of these keys.lua defines:
+--
+-- handle_midi_note(channel, note, velocity, on)
+-- handle_midi_cc(channel, controller, value)
+-- handle_midi_sysex(bytes)                         -- a string, F0 to F7
+-- handle_midi_message(status, channel, data1, data2)
+
+-- Light key x while note is on, scaled by velocity, without going through Lua
+-- keybow.midi_note_light(note) stops it again
+
+function keybow.midi_note_light(note, x, r, g, b)
+    keybow_midi_note_light(note, x, r, g, b)
+end
+
+-- MIDI clock from the host
+-- Returns running, locked (the tempo is known), bpm and beat, which counts
+-- beats since start with the fraction being how far through the beat it is.
+-- Define handle_midi_beat(beat) to be called on every beat.
+
+function keybow.get_midi_clock()
+    return keybow_get_midi_clock()
+end
+
+-- Step the lighting pattern frames_per_beat times a beat while the
+-- clock is running, keybow.lights_sync_clock(0) goes back to 60fps
+
+function keybow.lights_sync_clock(frames_per_beat)
+    keybow_lights_sync_clock(frames_per_beat)
+end
+
+-- MIDI input counters: received, dropped (Lua too slow), truncated SysEx
+
+function keybow.get_midi_stats()
+    return keybow_get_midi_stats()
 end
 
 -- Keybow Mini
@@ -6,7 +6,7 @@ require "keybow"
 
 function handle_key_00(pressed) -- Lorem Ipsum
     if pressed then
-        keybow.text([[
+        keybow.play_text([[
 Lorem ipsum dolor sit amet, consectetur adipiscing elit. Nam fermentum ante ac 
 tellus maximus, a tristique ligula sollicitudin. Mauris in molestie purus, a 
 dapibus libero. Duis at dolor nulla. Aliquam neque tortor, molestie ut lacus 
@@ -22,7 +22,7 @@ end
 
 function handle_key_01(pressed) -- Bacon Ipsum
     if pressed then
-        keybow.text([[
+        keybow.play_text([[
 Bacon ipsum dolor amet capicola spare ribs landjaeger bresaola biltong salami 
 flank meatball chuck fatback picanha. Pancetta pork loin ball tip shoulder 
 bresaola meatloaf pastrami sirloin porchetta leberkas. Drumstick brisket 
@@ -35,7 +35,7 @@ end
 
 function handle_key_02(pressed) -- Zombie Ipsum
     if pressed then
-        keybow.text([[
+        keybow.play_text([[
 Zombie ipsum reversus ab viral inferno, nam rick grimes malum cerebro. De 
 carne lumbering animata corpora quaeritis. Summus brains sit​​, morbo vel 
 maleficia? De apocalypsi gorger omero undead survivor dictum mauris. Hi 
@@ -51,49 +51,49 @@ end
 
 function handle_key_03(pressed) -- Pangrams
     if pressed then
-        keybow.text("The quick brown fox jumps over the lazy dog.")
+        keybow.play_text("The quick brown fox jumps over the lazy dog.")
     end
 end
 
 function handle_key_04(pressed)
     if pressed then
-        keybow.text("Pack my box with five dozen liquor jugs.")
+        keybow.play_text("Pack my box with five dozen liquor jugs.")
     end
 end
 
 function handle_key_05(pressed)
     if pressed then
-        keybow.text("How quickly daft jumping zebras vex.")
+        keybow.play_text("How quickly daft jumping zebras vex.")
     end
 end
 
 function handle_key_06(pressed) -- Python shebang
     if pressed then
-        keybow.text("£!/usr/bin/env python\n\n")
+        keybow.play_text("£!/usr/bin/env python\n\n")
     end
 end
 
 function handle_key_07(pressed) -- Python while loop
     if pressed then
-        keybow.text("while True:")
+        keybow.play_text("while True:")
     end
 end
 
 function handle_key_08(pressed) -- Python for loop
     if pressed then
-        keybow.text("for i in range(len()):")
+        keybow.play_text("for i in range(len()):")
     end
 end
 
 function handle_key_09(pressed) -- Bash shebang
     if pressed then
-        keybow.text("£!/usr/bin/env bash\n\n")
+        keybow.play_text("£!/usr/bin/env bash\n\n")
     end
 end
 
 function handle_key_10(pressed) -- HTML boilerplate (from https://gist.github.com/soniacs/4381504)
     if pressed then
-        keybow.text([[
+        keybow.play_text([[
 <!DOCTYPE html>
 <html>
 <head>
@@ -131,7 +131,7 @@ end
 
 function handle_key_11(pressed) -- CSS boilerplate (from https://gist.github.com/soniacs/4381504)
     if pressed then
-        keybow.text([[
+        keybow.play_text([[
 @font-face {}
 
 /* COMMON STYLES */